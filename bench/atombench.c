@@ -0,0 +1,356 @@
+#define _GNU_SOURCE // memmem, strcasestr
+
+// Microbenchmarks for the atom hot paths of a UI, run in the stub host:
+// port_event with streams of plugin messages, and ui_idle forging the
+// changes queued by the server thread.
+//
+//   atombench [-n iterations] [-p port] ui.so bundle/
+//
+// For bsynth the controlmsg stream is what the UI itself forged for every
+// control, recorded from ui->write, which is also what the plugin echoes.
+// Changes for ui_idle are queued with POST /controls outside the timing, or
+// written to the UI's shared memory control channel as a sequencer would.
+
+#include "httpclient.h"
+#include "stubhost.h"
+
+#include <lv2/atom/forge.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NOTIFY_PORT 1 // port the plugin's messages arrive on
+#define MAX_STREAM 256
+#define EVENT_SIZE 256 // longest message in a stream
+
+typedef struct {
+  uint8_t events[MAX_STREAM][EVENT_SIZE];
+  uint32_t length;
+} Stream_t;
+
+// The start of a control channel segment, as the UIs lay it out
+typedef struct {
+  uint32_t control;
+  float value;
+} ChannelRecord_t;
+
+typedef struct {
+  char magic[8];
+  uint32_t pid;
+  uint32_t ringSize;
+  uint32_t nmbControls;
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+  _Alignas(64) ChannelRecord_t ring[];
+} Channel_t;
+
+static StubHost_t host;
+static int fd = -1;
+static char *buffer;
+static Channel_t *channel;
+static char channelName[128];
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void stream_add(Stream_t *stream, const LV2_Atom *atom) {
+  uint32_t size = lv2_atom_total_size(atom);
+  if (stream->length < MAX_STREAM && size <= EVENT_SIZE)
+    memcpy(stream->events[stream->length++], atom, size);
+}
+
+// Objects of type otype among the recorded writes, sequences are unpacked
+static void stream_from_records(Stream_t *stream, LV2_URID otype) {
+  LV2_URID object = stub_map(&host, LV2_ATOM__Object);
+  LV2_URID sequence = stub_map(&host, LV2_ATOM__Sequence);
+  for (uint32_t i = 0; i < host.nmbRecords; i++) {
+    const LV2_Atom *atom = (const LV2_Atom *)host.records[i].data;
+    if (atom->type == sequence) {
+      LV2_ATOM_SEQUENCE_FOREACH((const LV2_Atom_Sequence *)atom, event) {
+        if (event->body.type == object &&
+            ((const LV2_Atom_Object *)&event->body)->body.otype == otype)
+          stream_add(stream, &event->body);
+      }
+    } else if (atom->type == object &&
+               ((const LV2_Atom_Object *)atom)->body.otype == otype) {
+      stream_add(stream, atom);
+    }
+  }
+}
+
+static void report(const char *name, uint64_t *ns, unsigned int count,
+                   unsigned int perOp) {
+  qsort(ns, count, sizeof(uint64_t), compare_ns);
+  double total = 0;
+  for (unsigned int i = 0; i < count; i++)
+    total += ns[i];
+  printf("%-34s %10.0f %10" PRIu64 " %10" PRIu64 " %10.1f\n", name,
+         total / count, ns[count / 2], ns[(unsigned int)(count * 0.99)],
+         total / count / perOp);
+}
+
+// Time port_event over the stream, in rounds of one pass each
+static void bench_port_event(const char *name, Stream_t *stream,
+                             unsigned int iterations) {
+  if (stream->length == 0) {
+    printf("%-34s no events\n", name);
+    return;
+  }
+  unsigned int rounds = iterations / stream->length + 1;
+  uint64_t *ns = malloc(rounds * sizeof(uint64_t));
+  for (unsigned int round = 0; round < rounds / 10; round++)
+    for (uint32_t i = 0; i < stream->length; i++)
+      stub_host_event(&host, NOTIFY_PORT, (const LV2_Atom *)stream->events[i]);
+  for (unsigned int round = 0; round < rounds; round++) {
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < stream->length; i++)
+      stub_host_event(&host, NOTIFY_PORT, (const LV2_Atom *)stream->events[i]);
+    ns[round] = (now_ns() - start) / stream->length;
+  }
+  report(name, ns, rounds, 1);
+  free(ns);
+}
+
+// Queue count changes through the server, then time the ui_idle that
+// forges them
+static bool queue_changes(unsigned int count, unsigned int round) {
+  uint8_t pairs[2 * 256];
+  for (unsigned int i = 0; i < count; i++) {
+    pairs[2 * i] = i;
+    pairs[2 * i + 1] = (round + i) % 128;
+  }
+  return http_request(fd, "POST", "/controls", "application/octet-stream",
+                      pairs, 2 * count, buffer, NULL, NULL) == 200;
+}
+
+static void bench_idle(const char *name, unsigned int count,
+                       unsigned int iterations) {
+  uint64_t *ns = malloc(iterations * sizeof(uint64_t));
+  for (unsigned int round = 0; round < iterations; round++) {
+    if (count > 0 && !queue_changes(count, round)) {
+      printf("%-34s POST /controls failed\n", name);
+      free(ns);
+      return;
+    }
+    uint64_t start = now_ns();
+    stub_host_idle(&host);
+    ns[round] = now_ns() - start;
+  }
+  report(name, ns, iterations, count > 0 ? count : 1);
+  free(ns);
+}
+
+// Map the control channel of the UI's instance, NULL when it has none
+static Channel_t *channel_map(void) {
+  char *body, instance[64];
+  size_t length;
+  if (http_request(fd, "GET", "/instances", NULL, NULL, 0, buffer, &body,
+                   &length) != 200 ||
+      sscanf(body, "[\"%63[^\"]", instance) != 1)
+    return NULL;
+  snprintf(channelName, sizeof(channelName), "%s%s", getenv("UI_BRIDGE_SHM"),
+           instance);
+  int shm = shm_open(channelName, O_RDWR, 0);
+  if (shm < 0)
+    return NULL;
+  struct stat status;
+  void *mapped = fstat(shm, &status) == 0
+                     ? mmap(NULL, status.st_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, shm, 0)
+                     : MAP_FAILED;
+  close(shm);
+  if (mapped == MAP_FAILED || memcmp(mapped, "LV2UISM1", 8) != 0)
+    return NULL;
+  return mapped;
+}
+
+// Write count records to the control channel, then time the ui_idle that
+// forges them
+static void bench_channel_idle(const char *name, unsigned int count,
+                               unsigned int iterations) {
+  if (channel == NULL || channel->nmbControls == 0 ||
+      count > channel->ringSize) {
+    printf("%-34s no control channel\n", name);
+    return;
+  }
+  uint64_t *ns = malloc(iterations * sizeof(uint64_t));
+  for (unsigned int round = 0; round < iterations; round++) {
+    uint32_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    for (unsigned int i = 0; i < count; i++)
+      channel->ring[(head + i) % channel->ringSize] = (ChannelRecord_t){
+          i % channel->nmbControls, (float)((round + i) % 128)};
+    atomic_store_explicit(&channel->head, head + count, memory_order_release);
+    uint64_t start = now_ns();
+    stub_host_idle(&host);
+    ns[round] = now_ns() - start;
+  }
+  report(name, ns, iterations, count);
+  free(ns);
+}
+
+static void bench_level_idle(const char *name, unsigned int iterations) {
+  uint64_t *ns = malloc(iterations * sizeof(uint64_t));
+  for (unsigned int round = 0; round < iterations; round++) {
+    char route[32];
+    snprintf(route, sizeof(route), "/level/%.2f", (round % 100) / 100.0);
+    if (http_request(fd, "GET", route, NULL, NULL, 0, buffer, NULL, NULL) !=
+        200) {
+      printf("%-34s GET /level failed\n", name);
+      free(ns);
+      return;
+    }
+    uint64_t start = now_ns();
+    stub_host_idle(&host);
+    ns[round] = now_ns() - start;
+  }
+  report(name, ns, iterations, 1);
+  free(ns);
+}
+
+static unsigned int count_controls(void) {
+  char *body;
+  size_t length;
+  unsigned int count = 0;
+  if (http_request(fd, "GET", "/controls", NULL, NULL, 0, buffer, &body,
+                   &length) != 200)
+    return 0;
+  for (char *at = body; (at = strstr(at, "\": ")) != NULL; at += 3)
+    count++;
+  return count;
+}
+
+static void bench_bsynth(unsigned int iterations) {
+  unsigned int nmbControls = count_controls();
+  if (nmbControls == 0 || nmbControls > 256) {
+    fprintf(stderr, "Unexpected /controls\n");
+    return;
+  }
+
+  // Record the messages forged for every control
+  static Stream_t controls, programs, stateChanged;
+  host.recording = true;
+  queue_changes(nmbControls, 0);
+  stub_host_idle(&host);
+  host.recording = false;
+  stream_from_records(&controls, stub_map(&host, "http://gareus.org/oss/lv2/"
+                                                 "b_synth#controlmsg"));
+
+  // Program names as the plugin reports them after a program change
+  LV2_Atom_Forge forge;
+  lv2_atom_forge_init(&forge, &host.map);
+  for (int program = 0; program < 128; program++) {
+    uint8_t message[EVENT_SIZE];
+    char name[32];
+    int length = snprintf(name, sizeof(name), "Program %d", program);
+    LV2_Atom_Forge_Frame frame;
+    lv2_atom_forge_set_buffer(&forge, message, sizeof(message));
+    LV2_Atom_Forge_Ref ref = lv2_atom_forge_object(
+        &forge, &frame, 0,
+        stub_map(&host, "http://gareus.org/oss/lv2/b_synth#midipgm"));
+    lv2_atom_forge_key(&forge, stub_map(&host, "http://gareus.org/oss/lv2/"
+                                               "b_synth#controlkey"));
+    lv2_atom_forge_int(&forge, program);
+    lv2_atom_forge_key(&forge, stub_map(&host, "http://gareus.org/oss/lv2/"
+                                               "b_synth#controlval"));
+    lv2_atom_forge_string(&forge, name, length);
+    lv2_atom_forge_pop(&forge, &frame);
+    stream_add(&programs, lv2_atom_forge_deref(&forge, ref));
+  }
+  LV2_Atom_Object changed = {
+      {sizeof(LV2_Atom_Object_Body), stub_map(&host, LV2_ATOM__Object)},
+      {0, stub_map(&host, "http://lv2plug.in/ns/ext/state#StateChanged")}};
+  stream_add(&stateChanged, &changed.atom);
+
+  bench_port_event("port_event controlmsg", &controls, iterations);
+  bench_port_event("port_event midipgm", &programs, iterations);
+  bench_port_event("port_event StateChanged", &stateChanged, iterations);
+
+  char name[64];
+  unsigned int idleIterations = iterations / 100 + 1;
+  bench_idle("ui_idle, nothing queued", 0, idleIterations);
+  bench_idle("ui_idle forging 1 change", 1, idleIterations);
+  bench_idle("ui_idle forging 16 changes", 16, idleIterations);
+  snprintf(name, sizeof(name), "ui_idle forging %u changes", nmbControls);
+  bench_idle(name, nmbControls, idleIterations);
+  bench_channel_idle("ui_idle draining 1 shm record", 1, idleIterations);
+  bench_channel_idle("ui_idle draining 16 shm records", 16, idleIterations);
+  snprintf(name, sizeof(name), "ui_idle draining %u shm records",
+           nmbControls);
+  bench_channel_idle(name, nmbControls, idleIterations);
+}
+
+static void bench_liquidsfz(unsigned int iterations) {
+  static Stream_t stateChanged;
+  LV2_Atom_Object changed = {
+      {sizeof(LV2_Atom_Object_Body), stub_map(&host, LV2_ATOM__Object)},
+      {0, stub_map(&host, "http://lv2plug.in/ns/ext/state#StateChanged")}};
+  stream_add(&stateChanged, &changed.atom);
+  bench_port_event("port_event StateChanged", &stateChanged, iterations);
+
+  unsigned int idleIterations = iterations / 100 + 1;
+  bench_idle("ui_idle, nothing queued", 0, idleIterations);
+  bench_level_idle("ui_idle writing 1 level", idleIterations);
+  bench_channel_idle("ui_idle draining 1 shm record", 1, idleIterations);
+  bench_channel_idle("ui_idle draining 16 shm records", 16, idleIterations);
+}
+
+int main(int argc, char **argv) {
+  unsigned int iterations = 1000000;
+  int option;
+  while ((option = getopt(argc, argv, "n:p:")) != -1) {
+    switch (option) {
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'p':
+      http_port = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n iterations] [-p port] ui.so bundle/\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || iterations == 0) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-p port] ui.so bundle/\n",
+            argv[0]);
+    return 1;
+  }
+
+  // liquidsfz takes its port and SFZ file from the environment, bsynth
+  // listens on 25550
+  char portText[16];
+  snprintf(portText, sizeof(portText), "%d", http_port);
+  setenv("HTTP_PORT", portText, 0);
+  setenv("SFZ_FILEPATH", "", 0);
+  setenv("UI_BRIDGE_SHM", "/atombench-", 0);
+
+  if (!stub_host_open(&host, argv[optind], argv[optind + 1]) ||
+      !http_wait_listening())
+    return 1;
+  buffer = malloc(RESPONSE_SIZE);
+  fd = http_connect();
+  channel = channel_map();
+  stub_host_idle(&host); // the messages forged by instantiate
+
+  printf("%s, %u iterations%s\n", host.descriptor->URI, iterations,
+         getenv("UI_BATCH_WRITES") ? ", UI_BATCH_WRITES" : "");
+  printf("%-34s %10s %10s %10s %10s\n", "benchmark", "mean ns", "p50 ns",
+         "p99 ns", "ns/message");
+  if (strstr(host.descriptor->URI, "bsynth") != NULL)
+    bench_bsynth(iterations);
+  else
+    bench_liquidsfz(iterations);
+  printf("ui->write calls %lu\n", atomic_load(&host.writes));
+  fflush(stdout);
+
+  // The UI server thread is left running, the process exits under it. The
+  // control channel would outlive it.
+  if (channel != NULL)
+    shm_unlink(channelName);
+  return 0;
+}
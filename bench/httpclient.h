@@ -0,0 +1,114 @@
+// Blocking HTTP/1.1 client for the benchmarks, one keep-alive connection per
+// caller to the UI server on the loopback interface. Needs _GNU_SOURCE for
+// memmem and strcasestr.
+
+#include <netinet/in.h>  // sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h> // socket APIs
+#include <unistd.h>
+
+#define RESPONSE_SIZE 65536 // receive buffer, larger bodies are streamed
+
+static int http_port = 25550;
+
+static inline int http_connect(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(http_port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Wait up to two seconds for the UI's server thread to listen
+static inline bool http_wait_listening(void) {
+  int fd = -1;
+  for (int i = 0; i < 200 && (fd = http_connect()) < 0; i++)
+    usleep(10000);
+  if (fd < 0) {
+    fprintf(stderr, "Nothing listening on port %d\n", http_port);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// Send one request and read the whole response into buffer, which holds
+// RESPONSE_SIZE bytes. Returns the status or -1 when the connection broke.
+// When body is given it points at the response body, empty if it did not fit.
+static inline int http_request(int fd, const char *method,
+                               const char *route, const char *contentType,
+                               const void *content, size_t contentLength,
+                               char *buffer, char **body, size_t *bodyLength) {
+  char request[512];
+  int length;
+  if (content != NULL)
+    length = snprintf(request, sizeof(request),
+                      "%s %s HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                      method, route, contentType, contentLength);
+  else
+    length = snprintf(request, sizeof(request),
+                      "%s %s HTTP/1.1\r\nHost: localhost\r\n\r\n", method,
+                      route);
+  if (send(fd, request, length, MSG_NOSIGNAL | (content ? MSG_MORE : 0)) !=
+      length)
+    return -1;
+  if (content != NULL && send(fd, content, contentLength, MSG_NOSIGNAL) !=
+                             (ssize_t)contentLength)
+    return -1;
+
+  size_t received = 0;
+  char *headersEnd = NULL;
+  while (headersEnd == NULL) {
+    ssize_t n = recv(fd, buffer + received, RESPONSE_SIZE - 1 - received, 0);
+    if (n <= 0)
+      return -1;
+    received += n;
+    headersEnd = memmem(buffer, received, "\r\n\r\n", 4);
+    if (headersEnd == NULL && received == RESPONSE_SIZE - 1)
+      return -1;
+  }
+  buffer[received] = '\0';
+  size_t headersLength = headersEnd + 4 - buffer;
+  *headersEnd = '\0';
+  int status = 0;
+  if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1)
+    return -1;
+  size_t responseLength = 0;
+  const char *field = strcasestr(buffer, "\r\nContent-Length:");
+  if (field != NULL)
+    responseLength = strtoul(field + 17, NULL, 10);
+
+  // Bodies that do not fit are read and dropped
+  size_t total = headersLength + responseLength;
+  while (received < total) {
+    size_t room = received < RESPONSE_SIZE - 1 ? RESPONSE_SIZE - 1 - received
+                                               : RESPONSE_SIZE - 1;
+    char *at = received < RESPONSE_SIZE - 1 ? buffer + received : buffer;
+    size_t want = total - received < room ? total - received : room;
+    ssize_t n = recv(fd, at, want, 0);
+    if (n <= 0)
+      return -1;
+    received += n;
+  }
+  if (body != NULL && total < RESPONSE_SIZE) {
+    *body = buffer + headersLength;
+    *bodyLength = responseLength;
+    buffer[total] = '\0';
+  } else if (body != NULL) {
+    *body = buffer;
+    *bodyLength = 0;
+    buffer[0] = '\0';
+  }
+  return status;
+}
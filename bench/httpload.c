@@ -0,0 +1,296 @@
+#define _GNU_SOURCE // memmem, strcasestr
+
+// HTTP load generator for the web UI servers. Loads a UI into a stub host,
+// so the server thread runs exactly as under jalv, and drives it over
+// loopback from concurrent keep-alive clients.
+//
+//   httpload [-c clients] [-d seconds] [-u idle Hz] [-p port]
+//            [-r [weight:]route]... ui.so bundle/
+//
+// Routes may contain %k, replaced by a control key taken from /controls, and
+// %v, replaced by a value 0..127. The default mix is
+// 4:/control/%v/%k 1:/controls 1:/programs 2:/index.html
+
+#include "httpclient.h"
+#include "stubhost.h"
+
+#define MAX_ROUTES 16
+#define MAX_KEYS 256
+
+typedef struct {
+  char route[128];
+  unsigned int weight;
+} Route_t;
+
+typedef struct {
+  uint64_t *ns;
+  size_t length;
+  size_t capacity;
+  unsigned long failed; // non 2xx/3xx answers
+} Samples_t;
+
+typedef struct {
+  pthread_t thread;
+  unsigned int seed;
+  unsigned long errors; // broken connections
+  Samples_t samples[MAX_ROUTES];
+} Client_t;
+
+static Route_t routes[MAX_ROUTES];
+static unsigned int nmbRoutes, totalWeight;
+static char *keys[MAX_KEYS];
+static unsigned int nmbKeys;
+static _Atomic bool running;
+
+static unsigned int next_random(unsigned int *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static void add_route(const char *spec) {
+  if (nmbRoutes == MAX_ROUTES) {
+    fprintf(stderr, "At most %d routes\n", MAX_ROUTES);
+    exit(1);
+  }
+  Route_t *route = &routes[nmbRoutes++];
+  const char *colon = strchr(spec, ':');
+  route->weight = 1;
+  if (colon != NULL && spec[0] != '/') {
+    route->weight = atoi(spec);
+    spec = colon + 1;
+  }
+  snprintf(route->route, sizeof(route->route), "%s", spec);
+  totalWeight += route->weight;
+}
+
+// Control keys in the /controls snapshot, for routes with %k
+static void fetch_keys(void) {
+  int fd = http_connect();
+  char *buffer = malloc(RESPONSE_SIZE);
+  char *body;
+  size_t length;
+  if (fd >= 0 && http_request(fd, "GET", "/controls", NULL, NULL, 0, buffer,
+                              &body, &length) == 200) {
+    char *key = body;
+    while (nmbKeys < MAX_KEYS && (key = strchr(key, '"')) != NULL) {
+      char *end = strchr(++key, '"');
+      if (end == NULL)
+        break;
+      keys[nmbKeys++] = strndup(key, end - key);
+      key = end + 1;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  free(buffer);
+}
+
+static void expand_route(const char *route, char *out, size_t size,
+                         unsigned int *seed) {
+  size_t length = 0;
+  for (; *route && length + 1 < size; route++) {
+    if (route[0] == '%' && route[1] == 'k' && nmbKeys > 0) {
+      length += snprintf(out + length, size - length, "%s",
+                         keys[next_random(seed) % nmbKeys]);
+      route++;
+    } else if (route[0] == '%' && route[1] == 'v') {
+      length += snprintf(out + length, size - length, "%u",
+                         next_random(seed) % 128);
+      route++;
+    } else {
+      out[length++] = *route;
+    }
+  }
+  out[length < size ? length : size - 1] = '\0';
+}
+
+static void record(Samples_t *samples, uint64_t ns) {
+  if (samples->length == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 4096;
+    samples->ns = realloc(samples->ns, samples->capacity * sizeof(uint64_t));
+    if (samples->ns == NULL) {
+      fprintf(stderr, "Out of memory for samples\n");
+      exit(1);
+    }
+  }
+  samples->ns[samples->length++] = ns;
+}
+
+static void *client_run(void *arg) {
+  Client_t *client = arg;
+  char *buffer = malloc(RESPONSE_SIZE);
+  char route[256];
+  int fd = -1;
+
+  while (atomic_load_explicit(&running, memory_order_relaxed)) {
+    if (fd < 0 && (fd = http_connect()) < 0) {
+      client->errors++;
+      usleep(1000);
+      continue;
+    }
+    unsigned int pick = next_random(&client->seed) % totalWeight;
+    unsigned int r = 0;
+    while (pick >= routes[r].weight)
+      pick -= routes[r++].weight;
+    expand_route(routes[r].route, route, sizeof(route), &client->seed);
+
+    uint64_t start = now_ns();
+    int status =
+        http_request(fd, "GET", route, NULL, NULL, 0, buffer, NULL, NULL);
+    uint64_t elapsed = now_ns() - start;
+    if (status < 0) {
+      client->errors++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    record(&client->samples[r], elapsed);
+    if (status >= 400)
+      client->samples[r].failed++;
+  }
+  if (fd >= 0)
+    close(fd);
+  free(buffer);
+  return NULL;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const Samples_t *samples, double p) {
+  if (samples->length == 0)
+    return 0;
+  size_t rank = (size_t)(p * (samples->length - 1) + 0.5);
+  return samples->ns[rank] / 1000.0;
+}
+
+static void report(const char *name, Samples_t *samples, double seconds) {
+  qsort(samples->ns, samples->length, sizeof(uint64_t), compare_ns);
+  printf("%-28s %9zu %10.0f %9.1f %9.1f %9.1f %8lu\n", name, samples->length,
+         samples->length / seconds, percentile(samples, 0.5),
+         percentile(samples, 0.99), percentile(samples, 0.999),
+         samples->failed);
+}
+
+static void merge(Samples_t *into, const Samples_t *from) {
+  for (size_t i = 0; i < from->length; i++)
+    record(into, from->ns[i]);
+  into->failed += from->failed;
+}
+
+int main(int argc, char **argv) {
+  unsigned int nmbClients = 8, seconds = 10, idleHz = 30;
+  int option;
+  while ((option = getopt(argc, argv, "c:d:u:p:r:")) != -1) {
+    switch (option) {
+    case 'c':
+      nmbClients = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atoi(optarg);
+      break;
+    case 'u':
+      idleHz = atoi(optarg);
+      break;
+    case 'p':
+      http_port = atoi(optarg);
+      break;
+    case 'r':
+      add_route(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-c clients] [-d seconds] [-u idle Hz] [-p port] "
+              "[-r [weight:]route]... ui.so bundle/\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || nmbClients == 0 || seconds == 0 || idleHz == 0) {
+    fprintf(stderr, "Usage: %s [options] ui.so bundle/\n", argv[0]);
+    return 1;
+  }
+  if (nmbRoutes == 0) {
+    add_route("4:/control/%v/%k");
+    add_route("1:/controls");
+    add_route("1:/programs");
+    add_route("2:/index.html");
+  }
+
+  // liquidsfz takes its port and SFZ file from the environment, bsynth
+  // listens on 25550
+  char portText[16];
+  snprintf(portText, sizeof(portText), "%d", http_port);
+  setenv("HTTP_PORT", portText, 0);
+  setenv("SFZ_FILEPATH", "", 0);
+
+  StubHost_t host = {0};
+  if (!stub_host_open(&host, argv[optind], argv[optind + 1]))
+    return 1;
+
+  if (!http_wait_listening())
+    return 1;
+  fetch_keys();
+  for (unsigned int i = 0; i < nmbRoutes; i++) {
+    if (strstr(routes[i].route, "%k") != NULL && nmbKeys == 0) {
+      fprintf(stderr, "No control keys for %s\n", routes[i].route);
+      return 1;
+    }
+  }
+
+  atomic_store(&running, true);
+  Client_t *clients = calloc(nmbClients, sizeof(Client_t));
+  for (unsigned int i = 0; i < nmbClients; i++) {
+    clients[i].seed = 2463534242u + i * 7919;
+    int k = pthread_create(&clients[i].thread, NULL, client_run, &clients[i]);
+    if (k != 0) {
+      fprintf(stderr, "%d : %s\n", k, "pthread_create : client thread");
+      return 1;
+    }
+  }
+
+  // The host drives ui_idle at a jalv like rate while the clients run
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)seconds * 1000000000u;
+  uint64_t period = 1000000000u / idleHz;
+  for (uint64_t tick = start; tick < end; tick += period) {
+    stub_host_idle(&host);
+    uint64_t now = now_ns();
+    if (tick + period > now) {
+      struct timespec pause = {0, tick + period - now};
+      nanosleep(&pause, NULL);
+    }
+  }
+  atomic_store(&running, false);
+  for (unsigned int i = 0; i < nmbClients; i++)
+    pthread_join(clients[i].thread, NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%s, %u clients, %.1f s, ui_idle at %u Hz\n", argv[optind],
+         nmbClients, elapsed, idleHz);
+  printf("%-28s %9s %10s %9s %9s %9s %8s\n", "route", "requests", "req/s",
+         "p50 us", "p99 us", "p999 us", "failed");
+  Samples_t all = {0};
+  unsigned long errors = 0;
+  for (unsigned int r = 0; r < nmbRoutes; r++) {
+    Samples_t route = {0};
+    for (unsigned int i = 0; i < nmbClients; i++)
+      merge(&route, &clients[i].samples[r]);
+    merge(&all, &route);
+    report(routes[r].route, &route, elapsed);
+    free(route.ns);
+  }
+  for (unsigned int i = 0; i < nmbClients; i++)
+    errors += clients[i].errors;
+  report("all", &all, elapsed);
+  printf("ui->write calls %lu, connection errors %lu\n",
+         atomic_load(&host.writes), errors);
+  fflush(stdout);
+
+  // The UI server thread is left running, the process exits under it
+  return 0;
+}
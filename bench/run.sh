@@ -0,0 +1,3 @@
+# Load the installed bsynth UI, e.g. ./run.sh -c 16 -d 20
+bundle=/usr/lib/lv2/bsynth_uiweb.lv2/
+./httpload "$@" ${bundle}bsynth_uiweb.so $bundle
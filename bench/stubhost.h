@@ -0,0 +1,180 @@
+// Minimal LV2 UI host for the benchmarks: loads a UI shared object and
+// instantiates it with the features the UIs ask for, without jalv, PipeWire
+// or the plugins themselves. ui->write calls can be recorded for replay.
+
+#include <lv2/atom/atom.h>
+#include <lv2/atom/util.h>
+#include <lv2/core/lv2.h>
+#include <lv2/log/log.h>
+#include <lv2/options/options.h>
+#include <lv2/ui/ui.h>
+#include <lv2/urid/urid.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_URIDS 1024
+#define MAX_RECORDS 256  // ui->write calls kept while recording
+#define RECORD_SIZE 8192 // longest recorded write, a whole batched sequence
+
+typedef struct {
+  uint32_t port;
+  uint32_t size;
+  uint32_t protocol;
+  uint8_t data[RECORD_SIZE];
+} StubWrite_t;
+
+typedef struct {
+  void *library;
+  const LV2UI_Descriptor *descriptor;
+  const LV2UI_Idle_Interface *idle;
+  LV2UI_Handle handle;
+  LV2UI_Write_Function write; // called for every ui->write, may be NULL
+  void *writeData;
+  _Atomic unsigned long writes; // ui->write calls seen
+  bool recording;
+  StubWrite_t *records;
+  uint32_t nmbRecords;
+  pthread_mutex_t uridLock;
+  char *uris[MAX_URIDS];
+  uint32_t nmbUris;
+  LV2_URID_Map map;
+  LV2_URID_Unmap unmap;
+  LV2_Log_Log log;
+  LV2_URID eventTransfer;
+  float updateRate;
+  LV2_Options_Option options[2];
+} StubHost_t;
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static LV2_URID stub_map(LV2_URID_Map_Handle handle, const char *uri) {
+  StubHost_t *host = handle;
+  LV2_URID urid = 0;
+  pthread_mutex_lock(&host->uridLock);
+  for (uint32_t i = 0; i < host->nmbUris && urid == 0; i++)
+    if (!strcmp(host->uris[i], uri))
+      urid = i + 1;
+  if (urid == 0 && host->nmbUris < MAX_URIDS) {
+    host->uris[host->nmbUris] = strdup(uri);
+    urid = ++host->nmbUris;
+  }
+  pthread_mutex_unlock(&host->uridLock);
+  return urid;
+}
+
+static const char *stub_unmap(LV2_URID_Unmap_Handle handle, LV2_URID urid) {
+  StubHost_t *host = handle;
+  const char *uri = NULL;
+  pthread_mutex_lock(&host->uridLock);
+  if (urid > 0 && urid <= host->nmbUris)
+    uri = host->uris[urid - 1];
+  pthread_mutex_unlock(&host->uridLock);
+  return uri;
+}
+
+static int stub_vprintf(LV2_Log_Handle handle, LV2_URID type, const char *fmt,
+                        va_list ap) {
+  return vfprintf(stderr, fmt, ap);
+}
+
+static int stub_printf(LV2_Log_Handle handle, LV2_URID type, const char *fmt,
+                       ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int written = vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  return written;
+}
+
+static void stub_write(LV2UI_Controller controller, uint32_t port,
+                       uint32_t size, uint32_t protocol, const void *buffer) {
+  StubHost_t *host = controller;
+  atomic_fetch_add_explicit(&host->writes, 1, memory_order_relaxed);
+  if (host->recording && host->nmbRecords < MAX_RECORDS &&
+      size <= RECORD_SIZE) {
+    StubWrite_t *record = &host->records[host->nmbRecords++];
+    record->port = port;
+    record->size = size;
+    record->protocol = protocol;
+    memcpy(record->data, buffer, size);
+  }
+  if (host->write != NULL)
+    host->write(host->writeData, port, size, protocol, buffer);
+}
+
+// Load the UI at path and instantiate it for the bundle directory, which must
+// end with '/' and hold the static directory
+static inline bool stub_host_open(StubHost_t *host, const char *path,
+                                  const char *bundle) {
+  pthread_mutex_init(&host->uridLock, NULL);
+  atomic_init(&host->writes, 0);
+  host->map = (LV2_URID_Map){host, stub_map};
+  host->unmap = (LV2_URID_Unmap){host, stub_unmap};
+  host->log = (LV2_Log_Log){host, stub_printf, stub_vprintf};
+  host->records = calloc(MAX_RECORDS, sizeof(StubWrite_t));
+  if (host->records == NULL) {
+    fprintf(stderr, "Out of memory for the write recorder\n");
+    return false;
+  }
+  host->eventTransfer = stub_map(host, LV2_ATOM__eventTransfer);
+  host->updateRate = 30;
+  host->options[0] = (LV2_Options_Option){
+      LV2_OPTIONS_INSTANCE, 0, stub_map(host, LV2_UI__updateRate),
+      sizeof(float), stub_map(host, LV2_ATOM__Float), &host->updateRate};
+  host->options[1] = (LV2_Options_Option){LV2_OPTIONS_INSTANCE, 0, 0, 0, 0,
+                                          NULL};
+
+  host->library = dlopen(path, RTLD_NOW);
+  if (host->library == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return false;
+  }
+  const LV2UI_Descriptor *(*descriptor)(uint32_t) =
+      (const LV2UI_Descriptor *(*)(uint32_t))dlsym(host->library,
+                                                   "lv2ui_descriptor");
+  if (descriptor == NULL || (host->descriptor = descriptor(0)) == NULL) {
+    fprintf(stderr, "%s : no LV2 UI descriptor\n", path);
+    return false;
+  }
+
+  const LV2_Feature map = {LV2_URID__map, &host->map};
+  const LV2_Feature unmap = {LV2_URID__unmap, &host->unmap};
+  const LV2_Feature log = {LV2_LOG__log, &host->log};
+  const LV2_Feature options = {LV2_OPTIONS__options, host->options};
+  const LV2_Feature *features[] = {&map, &unmap, &log, &options, NULL};
+  LV2UI_Widget widget;
+  host->handle = host->descriptor->instantiate(
+      host->descriptor, "urn:bench:plugin", bundle, stub_write, host, &widget,
+      features);
+  if (host->handle == NULL) {
+    fprintf(stderr, "%s : instantiate failed\n", path);
+    return false;
+  }
+  if (host->descriptor->extension_data != NULL)
+    host->idle = host->descriptor->extension_data(LV2_UI__idleInterface);
+  return true;
+}
+
+static inline void stub_host_idle(StubHost_t *host) {
+  if (host->idle != NULL)
+    host->idle->idle(host->handle);
+}
+
+// Deliver an atom to the UI as the plugin would, on its output port
+static inline void stub_host_event(StubHost_t *host, uint32_t port,
+                                   const LV2_Atom *atom) {
+  host->descriptor->port_event(host->handle, port, lv2_atom_total_size(atom),
+                               host->eventTransfer, atom);
+}
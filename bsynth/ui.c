@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // accept4, SOCK_NONBLOCK
+
 #include <lilv/lilv.h>
 #include <lv2/atom/atom.h>
 #include <lv2/atom/forge.h>
@@ -14,24 +16,84 @@
 #include <lv2/urid/urid.h>
 
 #include <assert.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <pthread.h>
 
-#include <netinet/in.h> // sockaddr_in
-#include <sys/socket.h> // socket APIs
-#include <unistd.h>     // open, close
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>   // sockaddr_in
+#include <sys/epoll.h>    // epoll APIs
+#include <sys/eventfd.h>  // eventfd
+#include <sys/mman.h>     // mmap, shm_open
+#include <sys/sendfile.h> // sendfile
+#include <sys/socket.h>   // socket APIs
+#include <sys/stat.h>     // stat
+#include <sys/uio.h>      // writev
+#include <sys/un.h>       // sockaddr_un
+#include <unistd.h>       // open, close
+
+#include <signal.h> // pthread_sigmask
+
+#define SIZE 4096 // buffer size
+
+#define BACKLOG 128 // number of pending connections queue will hold
+
+#define MAX_EVENTS 64 // epoll events handled per wakeup
+
+#define MAX_METHOD 16  // longest request method accepted
+#define MAX_HEADERS 32 // header fields accepted per request
+
+#define MAX_CONNECTIONS 64 // clients served at once by a worker, more are
+                           // turned away
+
+#define MAX_WORKERS 32 // event loop threads, UI_BRIDGE_WORKERS picks how many
+
+#define OSC_PACKET_SIZE 8192 // longest OSC datagram accepted
+#define OSC_MAX_CHANGES 256  // control changes applied together from a packet
+#define OSC_MAX_DEPTH 8      // nesting of OSC bundles
+#define BULK_MAX_CHANGES 256 // distinct controls a POST /controls can set
+#define MAX_LISTENERS 64 // instances with a Unix-domain socket of their own
+
+#define DRAIN_TIMEOUT_MS 250 // longest wait for responses in flight when the
+                             // server stops
+
+#define TRACE_COUNT 64 // traced control changes kept for /traces
+
+#define CHANNEL_MAGIC "LV2UISM1" // first bytes of a control channel segment
+#define CHANNEL_RING_SIZE 1024   // change records in the segment, power of 2
+#define CHANNEL_NAME 64          // longest control name in the segment
+
+#define HISTOGRAM_SUB_BITS 2  // each power of two is split in 1 << bits
+#define HISTOGRAM_BUCKETS 128 // in nanoseconds, up to about 4 s
+#define ARENA_SIZE 8192    // per connection, backs its body and response
+
+#define MAX_CACHED_FILE (1 << 20) // larger static files are sent with sendfile
+
+#define BROADCAST_SIZE 256   // plugin updates queued for streaming clients
+#define BROADCAST_LENGTH 64  // longest queued update
+#define STREAM_BACKLOG 65536 // unsent bytes before a streaming client is
+                             // dropped
+
+#define CHANGE_RING_SIZE 256 // control changes queued for ui_idle, power of 2
 
-#include <signal.h> // signal handling
+#define PROGRAM_CHANGE UINT16_MAX // ControlChange_t index of a program change
 
-#define SIZE 1024 // buffer size
+#define FORGE_BUFFER_SIZE 8192 // messages forged in one idle tick
+#define MESSAGE_SIZE 256       // room reserved for one forged message
 
-#define BACKLOG 10 // number of pending connections queue will hold
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
 #define UI_URI "http://helander.network/lv2uiweb/bsynth"
 
@@ -72,14 +134,223 @@ static char *definedControlKeys[] = {"upper.drawbar16",
                                      NULL};
 
 static int nmbControlKeys = sizeof(definedControlKeys) / sizeof(char *);
+_Static_assert(sizeof(definedControlKeys) / sizeof(char *) - 1 <=
+                   BULK_MAX_CHANGES,
+               "a POST /controls batch holds every control");
 
 typedef struct {
   char *key;
-  uint8_t value;
-  bool changed;
+  size_t keyLength;
+  uint32_t hash;
+  _Atomic uint8_t value;
+  _Atomic int pending; // latest value not yet sent to the plugin when the
+                       // change ring was full, -1 if none
+  _Atomic uint16_t trace; // traced change written to the plugin and waiting
+                          // for its echo, slot in traces plus one
 } PluginControl_t;
 
 typedef struct {
+  uint16_t index; // into pluginControls, or PROGRAM_CHANGE
+  uint8_t value;
+  uint64_t queued; // when the server thread queued it, for the metrics
+  uint16_t trace;  // slot in traces plus one, 0 when not traced
+} ControlChange_t;
+
+// The path of one control change tagged by a client, CLOCK_MONOTONIC
+// nanoseconds that stay 0 until the stage is reached. Readers copy a slot
+// and keep the copy only if sequence was even and unchanged meanwhile.
+typedef struct {
+  _Atomic unsigned int sequence; // odd while trace_begin refills the slot
+  _Atomic uint32_t id;           // sequence id given by the client
+  _Atomic unsigned long long clientTime; // on the client's clock
+  _Atomic uint16_t index;
+  _Atomic uint8_t value;
+  _Atomic uint64_t received;
+  _Atomic uint64_t enqueued;
+  _Atomic uint64_t dequeued;
+  _Atomic uint64_t written;
+  _Atomic uint64_t echoed;
+} Trace_t;
+
+// Producers (the workers) hold the instance's queueLock, the consumer
+// (ui_idle) needs no lock
+typedef struct {
+  ControlChange_t changes[CHANGE_RING_SIZE];
+  _Atomic unsigned int head;
+  _Atomic unsigned int tail;
+} ChangeRing_t;
+
+// Shared memory control channel of an instance, UI_BRIDGE_SHM. One external
+// process writes records at head and publishes them by advancing it, waiting
+// while the ring is full, and ui_idle consumes them. Each record is stored
+// and read as one 64 bit word. A writer that does not wait overruns the ring:
+// the oldest records are then dropped and counted as overrun. The controls
+// follow, in the order records refer to them, with the value last sent to or
+// reported by the plugin for readers to poll.
+typedef struct {
+  uint32_t control; // index into controls
+  float value;
+} ChannelRecord_t;
+
+_Static_assert(sizeof(ChannelRecord_t) == sizeof(uint64_t),
+               "a channel record is read with one 64 bit load");
+
+typedef struct {
+  char name[CHANNEL_NAME];
+  _Atomic float value;
+} ChannelControl_t;
+
+typedef struct {
+  char magic[8]; // CHANNEL_MAGIC, written once the rest is set up
+  uint32_t pid;  // of the host process
+  uint32_t ringSize;
+  uint32_t nmbControls;
+  _Alignas(64) _Atomic uint32_t head; // advanced by the writer
+  _Alignas(64) _Atomic uint32_t tail; // advanced by ui_idle
+  _Alignas(64) _Atomic uint64_t ring[CHANNEL_RING_SIZE]; // ChannelRecord_t
+  ChannelControl_t controls[];
+} Channel_t;
+
+// Requests are counted under the first label whose prefix matches the route
+static const char *routeLabels[][2] = {
+    {"/controls", "controls"}, {"/control/", "control"},
+    {"/programs", "programs"}, {"/program/", "program"},
+    {"/ws", "ws"},             {"/events", "events"},
+    {"/metrics", "metrics"},   {"/traces", "traces"},
+    {"/", "static"}};
+
+#define ROUTE_LABELS (sizeof(routeLabels) / sizeof(routeLabels[0]))
+
+// Log-linear, in the manner of HDR histograms: a bucket for each of the
+// 1 << HISTOGRAM_SUB_BITS steps within every power of two
+typedef struct {
+  _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t sum;
+} Histogram_t;
+
+// Updated with relaxed atomics from the server thread and the host's UI
+// thread, read by /metrics
+typedef struct {
+  _Atomic uint64_t requests[ROUTE_LABELS];
+  _Atomic uint64_t notFound;
+  _Atomic uint64_t bytesSent;
+  _Atomic int64_t connections;
+  _Atomic uint64_t oscApplied;  // OSC messages that set a control or program
+  _Atomic uint64_t oscRejected; // malformed or unknown, the server's only
+  _Atomic uint64_t channelApplied;  // control channel records staged
+  _Atomic uint64_t channelRejected; // for a control that does not exist
+  _Atomic uint64_t channelOverrun;  // dropped, the writer overran them
+  Histogram_t parseTime;
+  Histogram_t queueTime;
+  Histogram_t portEventTime;
+} Metrics_t;
+
+// A file under static_path, loaded when the server starts
+typedef struct StaticFile {
+  char route[100];
+  char path[PATH_MAX];
+  const char *mimeType;
+  time_t mtime;
+  char etag[40];
+  char headers[384]; // status line and entity headers, without the blank line
+  size_t headerLength;
+  char notModified[256]; // the same for a 304 reply
+  size_t notModifiedLength;
+  char *body; // NULL when the file is too large to keep in memory
+  size_t length;
+  const char *encoding;      // set on .gz/.br sidecars of another file
+  struct StaticFile *gzip;   // precompressed sidecars, if present
+  struct StaticFile *brotli;
+  struct StaticFile *next;
+} StaticFile_t;
+
+// A rendered JSON body, shared by the responses sent while it is current
+typedef struct {
+  _Atomic unsigned int refs; // the cache and each connection sending it
+  unsigned int version;
+  size_t capacity;
+  size_t length;
+  char data[];
+} Snapshot_t;
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t size;
+  char *arena; // fixed storage the buffer starts out in, data only moves to
+  size_t arenaSize; // the heap when a burst outgrows it
+} Buffer_t;
+
+typedef enum {
+  STREAM_NONE,
+  STREAM_WEBSOCKET, // upgraded, request holds WebSocket frames
+  STREAM_EVENTS     // text/event-stream, requests are no longer read
+} StreamType_t;
+
+typedef enum {
+  CONN_READING, // collecting and answering requests
+  CONN_WAITING, // parked until the plugin reports a state change
+  CONN_CLOSING,
+  CONN_CLOSED // freed once the current batch of events is handled
+} ConnectionState_t;
+
+// Views into the connection buffer: the parser NUL terminates the method,
+// the route and the header values in place
+typedef struct {
+  char *method;
+  char *route;
+  bool keepAlive;
+  bool binary; // body is application/octet-stream
+  size_t bodyOffset;
+  size_t bodyLength;
+  const char *ifNoneMatch; // NULL when absent
+  time_t ifModifiedSince;  // -1 when absent
+  bool acceptGzip;
+  bool acceptBrotli;
+  bool upgrade;           // asks for a WebSocket
+  bool connectionUpgrade; // Connection lists the upgrade option
+  const char *websocketKey;
+  const char *websocketVersion; // NULL when absent
+  size_t length;      // header block plus body
+  const char *error; // status of the reply when the request is rejected
+} HttpRequest_t;
+
+typedef struct Connection {
+  int socket;
+  struct Worker *worker; // whose pool and event loop it belongs to
+  struct ThisUI *ui;  // instance of the latest request, a stream or a parked
+                      // request stays with it
+  Metrics_t *metrics; // of that instance, the server's until then
+  struct ThisUI *home; // whose Unix-domain socket it came in on, NULL over TCP
+  ConnectionState_t state;
+  bool keepAlive;       // current request allows the connection to persist
+  bool closeAfterWrite; // no more requests are read from this connection
+  char request[SIZE];
+  size_t requestLength;
+  HttpRequest_t current; // request at the start of the buffer
+  bool headersParsed;    // its header block is complete and parsed
+  size_t scanned;        // bytes already searched for the end of the headers
+  Buffer_t body;     // body of the response being built
+  Buffer_t response; // responses queued for sending, in request order
+  size_t responseSent;
+  const StaticFile_t *file; // body sent after the queued response, later
+  Snapshot_t *snapshot;     // pipelined requests wait for it
+  int fileFd;               // open file when it goes out with sendfile
+  size_t bodySent;
+  StreamType_t stream;
+  struct Connection *nextWaiting;
+  struct Connection *nextStream;
+  struct Connection *nextClosed;
+  struct Connection *nextFree;
+} Connection_t;
+
+// A control update for the streaming clients of every worker
+typedef struct {
+  char text[BROADCAST_LENGTH]; // "<key> <value>"
+  int worker; // that already sent it to its own clients, -1 for the plugin's
+} Broadcast_t;
+
+typedef struct ThisUI {
   LV2_Atom_Forge forge;
   LV2_URID_Map *map;
   LV2_URID_Unmap *unmap;
@@ -113,31 +384,337 @@ typedef struct {
   LV2_URID bsynth_controlkey;
   LV2_URID bsynth_controlval;
 
-  uint8_t forge_buf[1024];
+  uint8_t forge_buf[FORGE_BUFFER_SIZE];
+  bool batchWrites; // UI_BATCH_WRITES set: one atom:Sequence per idle tick
+  Channel_t *channel; // NULL without UI_BRIDGE_SHM, only the UI thread uses it
+  size_t channelSize;
+  char channelName[NAME_MAX];
+  LV2_Atom_Forge_Frame batchFrame;
+  LV2_Atom_Forge_Ref batch; // open sequence, 0 when messages go out singly
+  int16_t *tickValues;      // latest value per control within an idle tick,
+                            // -1 if unchanged
+  uint16_t *tickChanged;    // controls with a tick value, in change order
+  uint16_t *tickTraces;     // trace of each tick value, 0 if none
+  int tickChangedCount;
 
   PluginControl_t *pluginControls;
+  uint16_t *controlSlots; // open addressing table of key hashes, holding
+                          // the index into pluginControls plus one
+  uint32_t controlSlotsMask;
   char program[128][100];
-  uint8_t currentProgram;
-  bool programChange;
+  _Atomic unsigned int stateVersion; // bumped on any control or program change
+  pthread_mutex_t snapshotLock; // the cached snapshots and rendered
+  Snapshot_t *controlsSnapshot;
+  Snapshot_t *programsSnapshot;
+  Buffer_t rendered; // scratch space for rendering snapshots
+
+  pthread_mutex_t queueLock; // workers queueing changes for ui_idle
+  ChangeRing_t changeRing;
+  _Atomic bool changesCoalesced; // pending values wait besides the ring
+  _Atomic int pendingProgram;
+
+  char name[64];              // routes under /i/<name>/ reach this instance
+  struct Listener *listener;  // its Unix-domain socket, NULL without one
+  struct ThisUI *nextInstance;
+  Metrics_t metrics;
+  Trace_t traces[TRACE_COUNT];
+  _Atomic unsigned int traceNext;
+  int notifyFds[MAX_WORKERS]; // one per worker, signalled by port_event and
+                              // by the other workers
+  pthread_mutex_t notifyLock; // the state changes and broadcasts below
+  unsigned int stateChanges;
+  unsigned int stateSeen[MAX_WORKERS];
+  Broadcast_t broadcast[BROADCAST_SIZE];
+  unsigned int broadcastHead;
+  unsigned int broadcastTails[MAX_WORKERS];
+
+} ThisUI;
+
+// Control changes decoded from an OSC packet. They are applied per instance
+// once the packet is decoded, so a bundle reaches ui_idle as one change.
+typedef struct {
+  ThisUI *ui[OSC_MAX_CHANGES];
+  ControlChange_t changes[OSC_MAX_CHANGES];
+  unsigned int count;
+} OscBatch_t;
 
-  int http_port;
-  pthread_t t_http_server;
+// Changes of a POST /controls body, one per control with the last value
+// given, so the whole body is applied as one batch
+typedef struct {
+  ThisUI *ui;
+  ControlChange_t changes[BULK_MAX_CHANGES];
+  uint16_t positions[BULK_MAX_CHANGES]; // by control index, in changes + 1
+  unsigned int count;
+} BulkBatch_t;
+
+// An event loop thread with its own listening socket on the shared port.
+// The kernel spreads new connections over the workers and a connection stays
+// with the one that accepted it.
+typedef struct Worker {
+  int index; // into the per worker state of the instances
+  pthread_t thread;
+  bool started;      // the thread runs or waits to be joined
+  bool serving;      // the thread has not left its event loop
+  ThisUI *detaching; // until the worker has let go of its connections
   int serverSocket;
-  int clientSocket;
-  char *request;
+  int epollFd;
+  int wakeFd; // signalled when an instance detaches or the server stops
+  Connection_t *connections; // pool allocated when the server starts
+  char *arenas;
+  Connection_t *freeConnections;
+  Connection_t *streamConnections;  // WebSocket and event stream clients
+  bool streamsPending;              // broadcasts queued but not yet flushed
+  Connection_t *waitingConnections; // parked /program requests
+  Connection_t *closedConnections;
+} Worker_t;
+
+// An instance's Unix-domain socket, UI_BRIDGE_SOCKET. Every worker watches
+// it and the one woken for a client accepts it.
+typedef struct Listener {
+  ThisUI *ui; // NULL for a free slot
+  int socket;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} Listener_t;
+
+// One server per process, shared by all instances of the UI. The first
+// instantiate starts it and the last cleanup stops it.
+typedef struct {
+  pthread_mutex_t lifecycle; // held while instances attach and detach
+  pthread_mutex_t lock; // instances, stopping, detachPending and the workers'
+                        // serving and detaching
+  pthread_cond_t detached;
+  int refs;
+  ThisUI *instances; // in instantiation order, the first one also answers
+                     // the routes without an /i/<name> prefix
+  int detachPending; // workers yet to let go of a detaching instance
+  bool started;      // all workers run
+  bool stopping;
+  StaticFile_t *staticFiles;
+  Metrics_t metrics; // connections, bytes sent and parse time of all
+                     // instances, the rest is counted per instance
+  Worker_t workers[MAX_WORKERS];
+  int nmbWorkers; // fixed while the server runs
+  int oscSocket;  // UDP, served by the first worker, -1 without OSC_PORT
+  Listener_t listeners[MAX_LISTENERS]; // slots are taken under lock
+} Server_t;
+
+static Server_t server = {.lifecycle = PTHREAD_MUTEX_INITIALIZER,
+                          .lock = PTHREAD_MUTEX_INITIALIZER,
+                          .detached = PTHREAD_COND_INITIALIZER,
+                          .oscSocket = -1};
+
+static uint8_t control_value(PluginControl_t *control) {
+  return atomic_load_explicit(&control->value, memory_order_relaxed);
+}
 
-} ThisUI;
+// Control values and program numbers are MIDI data bytes: every input path
+// rounds and clamps what it is given to 0..127
+static uint8_t midi_value(double value) {
+  return value >= 0 ? (value < 127 ? (uint8_t)(value + 0.5) : 127) : 0;
+}
 
-static PluginControl_t *getPluginControl(ThisUI *ui, char *key) {
-  for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
-       control++) {
-    if (!strcmp(key, control->key))
+static bool ring_push(ChangeRing_t *ring, ControlChange_t change) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == CHANGE_RING_SIZE)
+    return false;
+  ring->changes[head % CHANGE_RING_SIZE] = change;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+// Publish all changes at once, so ui_idle sees either all or none of them
+static bool ring_push_many(ChangeRing_t *ring, const ControlChange_t *changes,
+                           unsigned int count) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (CHANGE_RING_SIZE - (head - tail) < count)
+    return false;
+  for (unsigned int i = 0; i < count; i++)
+    ring->changes[(head + i) % CHANGE_RING_SIZE] = changes[i];
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+  return true;
+}
+
+static bool ring_pop(ChangeRing_t *ring, ControlChange_t *change) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail)
+    return false;
+  *change = ring->changes[tail % CHANGE_RING_SIZE];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+// FNV-1a
+static uint32_t key_hash(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  return hash;
+}
+
+// Index the controls by key once, so lookups from the plugin and the
+// clients take a single probe in the common case
+static bool build_control_registry(ThisUI *ui) {
+  uint32_t size = 16;
+  while (size < 2 * (uint32_t)nmbControlKeys)
+    size *= 2;
+  ui->controlSlots = calloc(size, sizeof(uint16_t));
+  if (ui->controlSlots == NULL)
+    return false;
+  ui->controlSlotsMask = size - 1;
+
+  for (int i = 0; i < nmbControlKeys - 1; i++) {
+    PluginControl_t *control = &ui->pluginControls[i];
+    uint32_t slot = control->hash & ui->controlSlotsMask;
+    while (ui->controlSlots[slot] != 0)
+      slot = (slot + 1) & ui->controlSlotsMask;
+    ui->controlSlots[slot] = i + 1;
+  }
+  return true;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void metric_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static unsigned int histogram_bucket(uint64_t ns) {
+  if (ns < (1 << HISTOGRAM_SUB_BITS))
+    return ns;
+  unsigned int exponent = 63 - __builtin_clzll(ns);
+  unsigned int step = (ns >> (exponent - HISTOGRAM_SUB_BITS)) &
+                      ((1 << HISTOGRAM_SUB_BITS) - 1);
+  unsigned int bucket =
+      ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + step;
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value counted in bucket
+static uint64_t histogram_bound(unsigned int bucket) {
+  if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    return bucket;
+  unsigned int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t step = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return (((1 << HISTOGRAM_SUB_BITS) + step + 1) << shift) - 1;
+}
+
+static void histogram_record(Histogram_t *histogram, uint64_t ns) {
+  metric_add(&histogram->counts[histogram_bucket(ns)], 1);
+  metric_add(&histogram->sum, ns);
+}
+
+static PluginControl_t *getPluginControl(ThisUI *ui, const char *key,
+                                         size_t length) {
+  uint32_t hash = key_hash(key, length);
+  for (uint32_t slot = hash & ui->controlSlotsMask;
+       ui->controlSlots[slot] != 0;
+       slot = (slot + 1) & ui->controlSlotsMask) {
+    PluginControl_t *control = &ui->pluginControls[ui->controlSlots[slot] - 1];
+    if (control->hash == hash && control->keyLength == length &&
+        !memcmp(control->key, key, length))
       return control;
   }
   return NULL;
 }
 
-static void *http_server_run(void *inst);
+// Whether the process that created the segment name still runs
+static bool channel_in_use(const char *name) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  struct {
+    char magic[8];
+    uint32_t pid;
+  } owner;
+  bool inUse = pread(fd, &owner, sizeof(owner), 0) == sizeof(owner) &&
+               !memcmp(owner.magic, CHANNEL_MAGIC, 8) &&
+               owner.pid != getpid() &&
+               (kill(owner.pid, 0) == 0 || errno == EPERM);
+  close(fd);
+  return inUse;
+}
+
+// Create the instance's control channel, named UI_BRIDGE_SHM followed by the
+// instance name, when UI_BRIDGE_SHM is set. A segment left by a process that
+// is gone is unlinked and a fresh one created, so whoever still maps the old
+// one keeps valid memory; one whose process still runs is left alone.
+static void channel_open(ThisUI *ui) {
+  const char *prefix = getenv("UI_BRIDGE_SHM");
+  if (prefix == NULL || *prefix == '\0')
+    return;
+  size_t length = snprintf(ui->channelName, sizeof(ui->channelName), "%s%s",
+                           prefix, ui->name);
+  if (prefix[0] != '/' || strchr(prefix + 1, '/') != NULL ||
+      length >= sizeof(ui->channelName)) {
+    printf("Error: UI_BRIDGE_SHM is not a shared memory name.\n");
+    return;
+  }
+  int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+  int fd = shm_open(ui->channelName, flags, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    if (channel_in_use(ui->channelName)) {
+      printf("Error: The control channel %s is in use.\n", ui->channelName);
+      return;
+    }
+    shm_unlink(ui->channelName);
+    fd = shm_open(ui->channelName, flags, 0600);
+  }
+  if (fd < 0) {
+    printf("Error: The control channel %s is not created.\n",
+           ui->channelName);
+    return;
+  }
+
+  uint32_t nmbControls = nmbControlKeys - 1;
+  size_t size = sizeof(Channel_t) + nmbControls * sizeof(ChannelControl_t);
+  Channel_t *channel = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    channel = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (channel == MAP_FAILED) {
+    printf("Error: The control channel %s is not mapped.\n", ui->channelName);
+    shm_unlink(ui->channelName);
+    return;
+  }
+  channel->pid = getpid();
+  channel->ringSize = CHANNEL_RING_SIZE;
+  channel->nmbControls = nmbControls;
+  for (uint32_t i = 0; i < nmbControls; i++) {
+    PluginControl_t *control = &ui->pluginControls[i];
+    snprintf(channel->controls[i].name, CHANNEL_NAME, "%s", control->key);
+    atomic_init(&channel->controls[i].value, control_value(control));
+  }
+  atomic_thread_fence(memory_order_release);
+  memcpy(channel->magic, CHANNEL_MAGIC, 8);
+  ui->channel = channel;
+  ui->channelSize = size;
+}
+
+// Readers that mapped the segment keep it, the name goes
+static void channel_close(ThisUI *ui) {
+  if (ui->channel == NULL)
+    return;
+  munmap(ui->channel, ui->channelSize);
+  shm_unlink(ui->channelName);
+  ui->channel = NULL;
+}
+
+static void channel_mirror(ThisUI *ui, uint16_t index, uint8_t value) {
+  if (ui->channel != NULL)
+    atomic_store_explicit(&ui->channel->controls[index].value, value,
+                          memory_order_relaxed);
+}
+
+static void server_attach(ThisUI *ui, int port);
+static void server_detach(ThisUI *ui);
+static void snapshot_release(Snapshot_t *snapshot);
 
 static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
                                 const char *plugin_uri, const char *bundle_path,
@@ -153,7 +730,6 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
   ui->controller = controller;
   sprintf(ui->plugin_uri, "%s", plugin_uri);
   sprintf(ui->static_path, "%sstatic", bundle_path);
-  ui->http_port = 25550;
 
   // Get host features
   // clang-format off
@@ -205,9 +781,31 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
   for (int i = 0; i < nmbControlKeys; i++) {
     PluginControl_t *control = &ui->pluginControls[i];
     control->key = definedControlKeys[i];
-    control->value = 0;
-    control->changed = false;
+    if (control->key != NULL) {
+      control->keyLength = strlen(control->key);
+      control->hash = key_hash(control->key, control->keyLength);
+    }
+    atomic_init(&control->value, 0);
+    atomic_init(&control->pending, -1);
+    atomic_init(&control->trace, 0);
+  }
+  ui->tickValues = malloc(nmbControlKeys * sizeof(int16_t));
+  ui->tickChanged = malloc(nmbControlKeys * sizeof(uint16_t));
+  ui->tickTraces = calloc(nmbControlKeys, sizeof(uint16_t));
+  if (ui->tickValues == NULL || ui->tickChanged == NULL ||
+      ui->tickTraces == NULL || !build_control_registry(ui)) {
+    lv2_log_error(&ui->logger, "Out of memory for the control registry\n");
+    free(ui->tickValues);
+    free(ui->tickChanged);
+    free(ui->tickTraces);
+    free(ui->pluginControls);
+    free(ui);
+    return NULL;
   }
+  for (int i = 0; i < nmbControlKeys; i++)
+    ui->tickValues[i] = -1;
+  ui->batchWrites = getenv("UI_BATCH_WRITES") != NULL;
+  atomic_init(&ui->pendingProgram, -1);
   for (int i = 0; i < 128; i++) {
     char *name = &ui->program[i][0];
     strcpy(name, "");
@@ -215,10 +813,12 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
 
   lv2_atom_forge_init(&ui->forge, ui->map);
 
-  int k = pthread_create(&ui->t_http_server, NULL, http_server_run, ui);
-  if (k != 0) {
-    fprintf(stderr, "%d : %s\n", k, "pthread_create : HTTPServer thread");fflush(stderr);
-  }
+  pthread_mutex_init(&ui->snapshotLock, NULL);
+  pthread_mutex_init(&ui->queueLock, NULL);
+  pthread_mutex_init(&ui->notifyLock, NULL);
+
+  server_attach(ui, 25550);
+  channel_open(ui);
 
   uint8_t obj_buf[400];
   lv2_atom_forge_set_buffer(&ui->forge, obj_buf, 400);
@@ -239,33 +839,205 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
 static void cleanup(LV2UI_Handle handle) {
   ThisUI *ui = (ThisUI *)handle;
 
-  pthread_join(ui->t_http_server, NULL);
-  close(ui->clientSocket);
-  close(ui->serverSocket);
-  if (ui->request != NULL)
-    free(ui->request);
-
+  server_detach(ui);
+  channel_close(ui);
+  snapshot_release(ui->controlsSnapshot);
+  snapshot_release(ui->programsSnapshot);
+  free(ui->rendered.data);
+  pthread_mutex_destroy(&ui->snapshotLock);
+  pthread_mutex_destroy(&ui->queueLock);
+  pthread_mutex_destroy(&ui->notifyLock);
+
+  free(ui->controlSlots);
+  free(ui->tickValues);
+  free(ui->tickChanged);
+  free(ui->tickTraces);
   free(ui->pluginControls);
   free(ui);
 }
 
-static void sendControls(ThisUI *ui) {
-    char response[200];
-    sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\n\r\n{");
-    send(ui->clientSocket, response, strlen(response), 0);
-    for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
-         control++) {
-      if (control == ui->pluginControls)
-        sprintf(response, "\"%s\": %d", control->key, control->value);
-      else
-        sprintf(response, ",\"%s\": %d", control->key, control->value);
-      send(ui->clientSocket, response, strlen(response), 0);
+static bool buffer_append(Buffer_t *buffer, const void *data, size_t length) {
+  if (buffer->length + length > buffer->size) {
+    size_t size = buffer->size ? buffer->size : SIZE;
+    while (size < buffer->length + length)
+      size *= 2;
+    bool inArena = buffer->data == buffer->arena;
+    char *grown = inArena ? malloc(size) : realloc(buffer->data, size);
+    if (grown == NULL)
+      return false;
+    if (inArena && buffer->length > 0)
+      memcpy(grown, buffer->data, buffer->length);
+    buffer->data = grown;
+    buffer->size = size;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return true;
+}
+
+// Empty the buffer and move it back into its arena
+static void buffer_recycle(Buffer_t *buffer) {
+  if (buffer->data != buffer->arena)
+    free(buffer->data);
+  buffer->data = buffer->arena;
+  buffer->size = buffer->arenaSize;
+  buffer->length = 0;
+}
+
+static bool buffer_printf(Buffer_t *buffer, const char *format, ...) {
+  char text[200];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (length < 0)
+    return false;
+  return buffer_append(buffer, text,
+                       (size_t)length < sizeof(text) ? (size_t)length
+                                                      : sizeof(text) - 1);
+}
+
+// Queue the body built so far as a complete response
+static void conn_respond(Connection_t *conn, const char *status,
+                         const char *contentType) {
+  Buffer_t *response = &conn->response;
+  if (!strncmp(status, "404", 3))
+    metric_add(&conn->metrics->notFound, 1);
+  bool ok = buffer_printf(response,
+                          "HTTP/1.1 %s\r\nAccess-Control-Allow-Origin: *\r\n",
+                          status);
+  if (contentType != NULL)
+    ok = ok && buffer_printf(response, "Content-Type: %s\r\n", contentType);
+  ok = ok && buffer_printf(response, "Content-Length: %zu\r\n%s\r\n",
+                           conn->body.length,
+                           conn->keepAlive ? "" : "Connection: close\r\n");
+  ok = ok && buffer_append(response, conn->body.data, conn->body.length);
+  conn->body.length = 0;
+  if (!ok)
+    conn->state = CONN_CLOSING;
+  if (!conn->keepAlive)
+    conn->closeAfterWrite = true;
+}
+
+static void controls_json(ThisUI *ui, Buffer_t *out) {
+  for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
+       control++) {
+    buffer_printf(out,
+                  control == ui->pluginControls ? "{\"%s\": %d" : ",\"%s\": %d",
+                  control->key, control_value(control));
+  }
+  buffer_append(out, "}", 1);
+}
+
+static void programs_json(ThisUI *ui, Buffer_t *out) {
+  buffer_printf(out, "{\"%d\": \"%s\"", 0, &ui->program[0][0]);
+  for (int i = 1; i < 128; i++) {
+    if (strlen(&ui->program[i][0]) > 0)
+      buffer_printf(out, ",\"%d\": \"%s\"", i, &ui->program[i][0]);
+  }
+  buffer_append(out, "}", 1);
+}
+
+static void snapshot_release(Snapshot_t *snapshot) {
+  if (snapshot != NULL &&
+      atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1)
+    free(snapshot);
+}
+
+// The cached rendering, redone only when the state version has moved on.
+// Returns it with a reference for the caller.
+static Snapshot_t *snapshot_get(ThisUI *ui, Snapshot_t **cache,
+                                void (*render)(ThisUI *, Buffer_t *)) {
+  unsigned int version =
+      atomic_load_explicit(&ui->stateVersion, memory_order_acquire);
+  pthread_mutex_lock(&ui->snapshotLock);
+  Snapshot_t *snapshot = *cache;
+  if (snapshot == NULL || snapshot->version != version) {
+    Buffer_t *rendered = &ui->rendered;
+    rendered->length = 0;
+    render(ui, rendered);
+
+    // Rendered over the old snapshot unless a connection is still sending
+    // it. References are only taken under the lock, so one that is the
+    // cache's alone stays so.
+    if (snapshot == NULL ||
+        atomic_load_explicit(&snapshot->refs, memory_order_acquire) > 1 ||
+        snapshot->capacity < rendered->length) {
+      size_t capacity = rendered->length + SIZE;
+      snapshot = malloc(sizeof(Snapshot_t) + capacity);
+      if (snapshot == NULL) {
+        pthread_mutex_unlock(&ui->snapshotLock);
+        return NULL;
+      }
+      atomic_init(&snapshot->refs, 1);
+      snapshot->capacity = capacity;
+      snapshot_release(*cache);
+      *cache = snapshot;
     }
-    send(ui->clientSocket, "}", 1, 0);
-    close(ui->clientSocket);
+    snapshot->version = version;
+    snapshot->length = rendered->length;
+    memcpy(snapshot->data, rendered->data, rendered->length);
+  }
+  atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&ui->snapshotLock);
+  return snapshot;
+}
+
+// Queue the headers, the body goes out from the snapshot itself
+static void conn_respond_snapshot(Connection_t *conn, Snapshot_t *snapshot) {
+  if (snapshot == NULL) {
+    conn_respond(conn, "500 Internal Server Error", NULL);
+    return;
+  }
+  if (!buffer_printf(&conn->response,
+                     "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n%s\r\n",
+                     snapshot->length,
+                     conn->keepAlive ? "" : "Connection: close\r\n"))
+    conn->state = CONN_CLOSING;
+  conn->snapshot = snapshot;
+  conn->bodySent = 0;
+  if (!conn->keepAlive)
+    conn->closeAfterWrite = true;
+}
+
+static void sendControls(ThisUI *ui, Connection_t *conn) {
+  conn_respond_snapshot(conn,
+                        snapshot_get(ui, &ui->controlsSnapshot, controls_json));
+}
+
+static void sendPrograms(ThisUI *ui, Connection_t *conn) {
+  conn_respond_snapshot(conn,
+                        snapshot_get(ui, &ui->programsSnapshot, programs_json));
 }
 
 
+// Queue an update for the streaming clients and wake the workers, except
+// the one it came from, which has sent it to its own clients already. A
+// worker that falls behind misses the oldest updates.
+static void post_notification(ThisUI *ui, const char *key, int value,
+                              Worker_t *from) {
+  if (from != NULL && server.nmbWorkers == 1)
+    return;
+  pthread_mutex_lock(&ui->notifyLock);
+  if (key != NULL) {
+    Broadcast_t *broadcast = &ui->broadcast[ui->broadcastHead % BROADCAST_SIZE];
+    snprintf(broadcast->text, BROADCAST_LENGTH, "%s %d", key, value);
+    broadcast->worker = from != NULL ? from->index : -1;
+    ui->broadcastHead++;
+  } else {
+    ui->stateChanges++;
+  }
+  pthread_mutex_unlock(&ui->notifyLock);
+
+  uint64_t one = 1;
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    if (&server.workers[i] != from)
+      write(ui->notifyFds[i], &one, sizeof(one));
+  }
+}
+
 static void an_object(ThisUI *ui, uint32_t port_index, LV2_Atom_Object *obj) {
   if (obj->body.otype == ui->bsynth_controlmsg) {
     fflush(stdout);
@@ -282,10 +1054,25 @@ static void an_object(ThisUI *ui, uint32_t port_index, LV2_Atom_Object *obj) {
     }
     if (keyAtom != NULL && valueAtom != NULL) {
       char *key = ((char *)keyAtom) + sizeof(LV2_Atom_String);
-      uint8_t value = valueAtom->body;
-      PluginControl_t *pluginControl = getPluginControl(ui, key);
+      uint8_t value = midi_value(valueAtom->body);
+      PluginControl_t *pluginControl =
+          getPluginControl(ui, key, strnlen(key, keyAtom->atom.size));
       if (pluginControl != NULL) {
-        pluginControl->value = value;
+        if (atomic_exchange_explicit(&pluginControl->value, value,
+                                     memory_order_relaxed) != value)
+          atomic_fetch_add_explicit(&ui->stateVersion, 1,
+                                    memory_order_release);
+        channel_mirror(ui, pluginControl - ui->pluginControls, value);
+        uint16_t trace =
+            atomic_load_explicit(&pluginControl->trace, memory_order_relaxed);
+        if (trace != 0 &&
+            atomic_load_explicit(&ui->traces[trace - 1].value,
+                                 memory_order_relaxed) == value) {
+          atomic_store_explicit(&pluginControl->trace, 0, memory_order_relaxed);
+          atomic_store_explicit(&ui->traces[trace - 1].echoed, now_ns(),
+                                memory_order_relaxed);
+        }
+        post_notification(ui, key, value, NULL);
       } else {
         printf("\nNo Control defined for  key %s", key);
         fflush(stdout);
@@ -310,10 +1097,15 @@ static void an_object(ThisUI *ui, uint32_t port_index, LV2_Atom_Object *obj) {
         if (p->value.type == ui->atom_String)
           valueAtom = (LV2_Atom_String *)&p->value;
     }
-    if (keyAtom != NULL && valueAtom != NULL) {
+    if (keyAtom != NULL && valueAtom != NULL && keyAtom->body >= 0 &&
+        keyAtom->body < 128) {
       char *value = ((char *)valueAtom) + sizeof(LV2_Atom_String);
-      uint8_t key = keyAtom->body;
-      strcpy(&ui->program[key][0], value);
+      // programs_json renders the names under snapshotLock
+      pthread_mutex_lock(&ui->snapshotLock);
+      snprintf(ui->program[keyAtom->body], sizeof(ui->program[0]), "%.*s",
+               (int)strnlen(value, valueAtom->atom.size), value);
+      atomic_fetch_add_explicit(&ui->stateVersion, 1, memory_order_release);
+      pthread_mutex_unlock(&ui->snapshotLock);
     } else {
       printf("\nProgram message property error");
       fflush(stdout);
@@ -322,7 +1114,9 @@ static void an_object(ThisUI *ui, uint32_t port_index, LV2_Atom_Object *obj) {
   }
 
   if (obj->body.otype == ui->state_Changed) {
-    sendControls(ui);
+    atomic_fetch_add_explicit(&ui->stateVersion, 1, memory_order_release);
+    // Parked /program requests are answered by the workers
+    post_notification(ui, NULL, 0, NULL);
     return;
   }
 }
@@ -356,58 +1150,206 @@ static void port_event(LV2UI_Handle handle, uint32_t port_index,
 
   LV2_Atom_Object *obj = (LV2_Atom_Object *)atom;
 
+  uint64_t start = now_ns();
   an_object(ui, port_index, obj);
+  histogram_record(&ui->metrics.portEventTime, now_ns() - start);
 }
 
-/* Idle interface for UI. */
-static int ui_idle(LV2UI_Handle handle) {
-  ThisUI *ui = (ThisUI *)handle;
+static void batch_begin(ThisUI *ui) {
+  lv2_atom_forge_set_buffer(&ui->forge, ui->forge_buf, sizeof(ui->forge_buf));
+  ui->batch = 0;
+  if (ui->batchWrites)
+    ui->batch = lv2_atom_forge_sequence_head(&ui->forge, &ui->batchFrame, 0);
+}
 
-  for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
-       control++) {
-    if (control->changed) {
-      uint8_t obj_buf[2000];
-      lv2_atom_forge_set_buffer(&ui->forge, obj_buf, 2000);
+static void batch_end(ThisUI *ui) {
+  if (!ui->batch)
+    return;
+  lv2_atom_forge_pop(&ui->forge, &ui->batchFrame);
+  LV2_Atom *sequence = lv2_atom_forge_deref(&ui->forge, ui->batch);
+  if (sequence->size > sizeof(LV2_Atom_Sequence_Body))
+    ui->write(ui->controller, 0, lv2_atom_total_size(sequence),
+              ui->atom_eventTransfer, sequence);
+  ui->batch = 0;
+}
+
+// Forge messages into forge_buf: each one on its own, or appended to the
+// open sequence, which is written out early when it is full
+static void message_begin(ThisUI *ui) {
+  if (!ui->batch) {
+    lv2_atom_forge_set_buffer(&ui->forge, ui->forge_buf,
+                              sizeof(ui->forge_buf));
+    return;
+  }
+  if (ui->forge.size - ui->forge.offset < MESSAGE_SIZE) {
+    batch_end(ui);
+    batch_begin(ui);
+  }
+  lv2_atom_forge_frame_time(&ui->forge, 0);
+}
+
+static void message_end(ThisUI *ui, LV2_Atom_Forge_Ref message) {
+  if (ui->batch)
+    return; // written with the sequence
+  LV2_Atom *msg = lv2_atom_forge_deref(&ui->forge, message);
+  ui->write(ui->controller, 0, lv2_atom_total_size(msg),
+            ui->atom_eventTransfer, msg);
+}
+
+static void forge_control(ThisUI *ui, PluginControl_t *control,
+                          uint8_t value) {
+  message_begin(ui);
 
-      LV2_Atom_Forge_Frame frame;
-      lv2_atom_forge_frame_time(&ui->forge, 0);
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom_Forge_Ref msg =
+      lv2_atom_forge_object(&ui->forge, &frame, 0, ui->bsynth_controlmsg);
+  lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlkey, 0);
+  lv2_atom_forge_string(&ui->forge, control->key, control->keyLength);
+  lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlval, 0);
+  lv2_atom_forge_int(&ui->forge, value);
 
-      LV2_Atom *msg = (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0,
-                                                        ui->bsynth_controlmsg);
-      lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlkey, 0);
-      lv2_atom_forge_string(&ui->forge, control->key, strlen(control->key));
-      lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlval, 0);
-      lv2_atom_forge_int(&ui->forge, control->value);
+  lv2_atom_forge_pop(&ui->forge, &frame);
 
-      lv2_atom_forge_pop(&ui->forge, &frame);
+  message_end(ui, msg);
+}
 
-      ui->write(ui->controller, 0, lv2_atom_total_size(msg),
-                ui->atom_eventTransfer, msg);
+static void forge_program(ThisUI *ui, uint8_t program) {
+  message_begin(ui);
 
-      control->changed = false;
-    }
-  }
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom_Forge_Ref msg =
+      lv2_atom_forge_object(&ui->forge, &frame, 0, ui->bsynth_midipgm);
+  lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlkey, 0);
+  lv2_atom_forge_int(&ui->forge, program);
+
+  lv2_atom_forge_pop(&ui->forge, &frame);
 
-  if (ui->programChange) {
-    uint8_t obj_buf[2000];
-    lv2_atom_forge_set_buffer(&ui->forge, obj_buf, 2000);
+  message_end(ui, msg);
+}
+
+// Only the latest value of a control within one idle tick is sent
+static void stage_change(ThisUI *ui, uint16_t index, uint8_t value,
+                         uint16_t trace) {
+  if (ui->tickValues[index] < 0)
+    ui->tickChanged[ui->tickChangedCount++] = index;
+  ui->tickValues[index] = value;
+  ui->tickTraces[index] = trace;
+}
 
-    LV2_Atom_Forge_Frame frame;
-    lv2_atom_forge_frame_time(&ui->forge, 0);
+static void forge_staged_changes(ThisUI *ui) {
+  for (int i = 0; i < ui->tickChangedCount; i++) {
+    uint16_t index = ui->tickChanged[i];
+    PluginControl_t *control = &ui->pluginControls[index];
+    forge_control(ui, control, ui->tickValues[index]);
+    channel_mirror(ui, index, ui->tickValues[index]);
+    ui->tickValues[index] = -1;
+
+    uint16_t trace = ui->tickTraces[index];
+    if (trace != 0) {
+      atomic_store_explicit(&ui->traces[trace - 1].written, now_ns(),
+                            memory_order_relaxed);
+      atomic_store_explicit(&control->trace, trace, memory_order_relaxed);
+      ui->tickTraces[index] = 0;
+    }
+  }
+  ui->tickChangedCount = 0;
+}
 
-    LV2_Atom *msg = (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0,
-                                                      ui->bsynth_midipgm);
-    lv2_atom_forge_property_head(&ui->forge, ui->bsynth_controlkey, 0);
-    lv2_atom_forge_int(&ui->forge, ui->currentProgram);
+// Stage what an external process wrote to the control channel, values
+// rounded and clamped to 0..127. Streaming clients hear of the changes from
+// the plugin's echo.
+static void channel_drain(ThisUI *ui) {
+  Channel_t *channel = ui->channel;
+  if (channel == NULL)
+    return;
+  uint32_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&channel->head, memory_order_acquire);
+  if (head == tail)
+    return;
+  uint64_t overrun = 0;
+  if (head - tail > CHANNEL_RING_SIZE) { // a writer that overran the ring
+    overrun = head - tail - CHANNEL_RING_SIZE;
+    tail = head - CHANNEL_RING_SIZE;
+  }
+  uint64_t applied = 0, rejected = 0;
+  bool changed = false;
+  for (; tail != head; tail++) {
+    uint64_t word = atomic_load_explicit(
+        &channel->ring[tail % CHANNEL_RING_SIZE], memory_order_relaxed);
+    // Rewritten meanwhile when the writer has since come a ring round
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&channel->head, memory_order_relaxed) - tail >=
+        CHANNEL_RING_SIZE) {
+      overrun++;
+      continue;
+    }
+    ChannelRecord_t record;
+    memcpy(&record, &word, sizeof(record));
+    if (record.control >= (uint32_t)nmbControlKeys - 1) {
+      rejected++;
+      continue;
+    }
+    uint8_t value = midi_value(record.value);
+    if (atomic_exchange_explicit(&ui->pluginControls[record.control].value,
+                                 value, memory_order_relaxed) != value)
+      changed = true;
+    stage_change(ui, record.control, value, 0);
+    applied++;
+  }
+  atomic_store_explicit(&channel->tail, tail, memory_order_release);
+  // Cached snapshots and their ETags stay valid while nothing changed
+  if (changed)
+    atomic_fetch_add_explicit(&ui->stateVersion, 1, memory_order_release);
+  metric_add(&ui->metrics.channelApplied, applied);
+  metric_add(&ui->metrics.channelRejected, rejected);
+  metric_add(&ui->metrics.channelOverrun, overrun);
+}
 
-    lv2_atom_forge_pop(&ui->forge, &frame);
+/* Idle interface for UI. */
+static int ui_idle(LV2UI_Handle handle) {
+  ThisUI *ui = (ThisUI *)handle;
 
-    ui->write(ui->controller, 0, lv2_atom_total_size(msg),
-              ui->atom_eventTransfer, msg);
+  batch_begin(ui);
+
+  // A program change resets the controls, so changes made before it go
+  // first
+  ControlChange_t change;
+  while (ring_pop(&ui->changeRing, &change)) {
+    // Read after the pop, so a change queued meanwhile cannot be newer
+    uint64_t now = now_ns();
+    histogram_record(&ui->metrics.queueTime, now - change.queued);
+    if (change.trace != 0)
+      atomic_store_explicit(&ui->traces[change.trace - 1].dequeued, now,
+                            memory_order_relaxed);
+    if (change.index == PROGRAM_CHANGE) {
+      forge_staged_changes(ui);
+      forge_program(ui, change.value);
+    } else {
+      stage_change(ui, change.index, change.value, change.trace);
+    }
+  }
 
-    ui->programChange = false;
+  // Changes that arrived while the ring was full, latest value per control.
+  // They are newer than anything that was in the ring.
+  if (atomic_exchange_explicit(&ui->changesCoalesced, false,
+                               memory_order_acquire)) {
+    for (int i = 0; i < nmbControlKeys - 1; i++) {
+      int pending = atomic_exchange_explicit(&ui->pluginControls[i].pending,
+                                             -1, memory_order_relaxed);
+      if (pending >= 0)
+        stage_change(ui, i, pending, 0);
+    }
+    int program = atomic_exchange_explicit(&ui->pendingProgram, -1,
+                                           memory_order_relaxed);
+    if (program >= 0) {
+      forge_staged_changes(ui);
+      forge_program(ui, program);
+    }
   }
 
+  channel_drain(ui);
+  forge_staged_changes(ui);
+  batch_end(ui);
   return 0;
 }
 
@@ -435,137 +1377,2240 @@ LV2_SYMBOL_EXPORT const LV2UI_Descriptor *lv2ui_descriptor(uint32_t index) {
   return index == 0 ? &descriptor : NULL;
 }
 
-static void handleSignal(int signal) {}
+static uint32_t rol32(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
 
-#define MTU_SIZE 1500
-static void send_file_to_socket(char *filepath, int socket) {
-  FILE *file = fopen(filepath, "rb");
-  if (file == NULL) {
-    char *stat404 = "HTTP/1.1 404 Not Found\r\n\r\n";
-    send(socket, stat404, strlen(stat404), 0);
-    return;
-  }
-  char *prefix = "HTTP/1.1 200 OK\r\n\r\n";
-  send(socket, prefix, strlen(prefix), 0);
-  unsigned char mtu[MTU_SIZE];
-  int bytes_read;
+// SHA-1 as needed for the WebSocket handshake (RFC 3174)
+static void sha1(const uint8_t *data, size_t length, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  size_t total = ((length + 8) / 64 + 1) * 64;
+  uint8_t block[64];
+
+  for (size_t offset = 0; offset < total; offset += 64) {
+    for (int i = 0; i < 64; i++) {
+      size_t pos = offset + i;
+      if (pos < length)
+        block[i] = data[pos];
+      else if (pos == length)
+        block[i] = 0x80;
+      else if (pos >= total - 8)
+        block[i] = (uint8_t)((uint64_t)length * 8 >> (8 * (total - 1 - pos)));
+      else
+        block[i] = 0;
+    }
 
-  while ((bytes_read = fread(mtu, 1, MTU_SIZE, file)) > 0) {
-    if (send(socket, mtu, bytes_read, 0) < bytes_read) {
-      printf("\nError sending file data to client");
-      fflush(stdout);
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+             (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+      w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rol32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol32(b, 30);
+      b = a;
+      a = temp;
     }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
   }
-  fclose(file);
+
+  for (int i = 0; i < 20; i++)
+    digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
 }
 
-static void *http_server_run(void *inst) {
-  ThisUI *ui = (ThisUI *)inst;
+static void base64_encode(const uint8_t *data, size_t length, char *out) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t triple = (uint32_t)data[i] << 16;
+    if (i + 1 < length)
+      triple |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length)
+      triple |= data[i + 2];
+    *out++ = alphabet[(triple >> 18) & 0x3F];
+    *out++ = alphabet[(triple >> 12) & 0x3F];
+    *out++ = i + 1 < length ? alphabet[(triple >> 6) & 0x3F] : '=';
+    *out++ = i + 2 < length ? alphabet[triple & 0x3F] : '=';
+  }
+  *out = '\0';
+}
 
-  signal(SIGINT, handleSignal);
+// Queue one unmasked, unfragmented frame
+static void websocket_send(Connection_t *conn, int opcode, const char *payload,
+                           size_t length) {
+  uint8_t header[4] = {0x80 | opcode};
+  size_t headerLength = 2;
+  if (length < 126) {
+    header[1] = length;
+  } else {
+    header[1] = 126;
+    header[2] = length >> 8;
+    header[3] = length & 0xFF;
+    headerLength = 4;
+  }
+  if (!buffer_append(&conn->response, header, headerLength) ||
+      !buffer_append(&conn->response, payload, length))
+    conn->state = CONN_CLOSING;
+}
 
-  struct sockaddr_in serverAddress;
-  serverAddress.sin_family = AF_INET; // IPv4
-  serverAddress.sin_port =
-      htons(ui->http_port); // port number in network byte order
-                            // (host-to-network short)
-  serverAddress.sin_addr.s_addr =
-      htonl(INADDR_ANY); // localhost (host to network long)
+static bool stream_ready(Connection_t *conn) {
+  if (conn->state == CONN_CLOSING)
+    return false;
+  if (conn->response.length > STREAM_BACKLOG) {
+    // Too slow to keep up, let it reconnect and refetch the current state
+    conn->state = CONN_CLOSING;
+    return false;
+  }
+  conn->worker->streamsPending = true;
+  return true;
+}
 
-  ui->serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+// Send a "<key> <value>" control update to every streaming client of the
+// instance on the worker except the one it came from
+static void broadcast_control(Worker_t *worker, ThisUI *ui, const char *text,
+                              Connection_t *origin) {
+  for (Connection_t *conn = worker->streamConnections; conn != NULL;
+       conn = conn->nextStream) {
+    if (conn->ui != ui || conn == origin || !stream_ready(conn))
+      continue;
+    if (conn->stream == STREAM_WEBSOCKET) {
+      websocket_send(conn, 0x1, text, strlen(text));
+    } else {
+      char key[50];
+      int value;
+      if (sscanf(text, "%49s %d", key, &value) == 2 &&
+          !buffer_printf(&conn->response,
+                         "event: control\ndata: {\"%s\": %d}\n\n", key, value))
+        conn->state = CONN_CLOSING;
+    }
+  }
+}
 
-  setsockopt(ui->serverSocket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
-             sizeof(int));
+static void stream_state(ThisUI *ui, Connection_t *conn) {
+  bool ok = buffer_printf(&conn->response, "event: state\ndata: ");
+  controls_json(ui, &conn->response);
+  if (!ok || !buffer_append(&conn->response, "\n\n", 2))
+    conn->state = CONN_CLOSING;
+}
 
-  if (bind(ui->serverSocket, (struct sockaddr *)&serverAddress,
-           sizeof(serverAddress)) < 0) {
-    printf("Error: The server is not bound to the address.\n");
-    return NULL;
+// Send the complete control table to the event stream clients of the
+// instance on the worker
+static void broadcast_state(Worker_t *worker, ThisUI *ui) {
+  for (Connection_t *conn = worker->streamConnections; conn != NULL;
+       conn = conn->nextStream) {
+    if (conn->ui == ui && conn->stream == STREAM_EVENTS && stream_ready(conn))
+      stream_state(ui, conn);
   }
+}
 
-  if (listen(ui->serverSocket, BACKLOG) < 0) {
-    printf("Error: The server is not listening.\n");
-    return NULL;
+// Hand a change to ui_idle without ever waiting for it. Once the ring is
+// full, changes are coalesced to the latest value per control until ui_idle
+// has caught up, so the plugin still sees them in order.
+static void queue_change(ThisUI *ui, uint16_t index, uint8_t value,
+                         uint16_t trace) {
+  uint64_t queued = now_ns();
+  // Stamped before the change is published, so it precedes the dequeue
+  if (trace != 0)
+    atomic_store_explicit(&ui->traces[trace - 1].enqueued, queued,
+                          memory_order_relaxed);
+  pthread_mutex_lock(&ui->queueLock);
+  if (!atomic_load_explicit(&ui->changesCoalesced, memory_order_relaxed) &&
+      ring_push(&ui->changeRing,
+                (ControlChange_t){index, value, queued, trace})) {
+    pthread_mutex_unlock(&ui->queueLock);
+    return;
   }
+  if (index == PROGRAM_CHANGE)
+    atomic_store_explicit(&ui->pendingProgram, value, memory_order_relaxed);
+  else
+    atomic_store_explicit(&ui->pluginControls[index].pending, value,
+                          memory_order_relaxed);
+  atomic_store_explicit(&ui->changesCoalesced, true, memory_order_release);
+  pthread_mutex_unlock(&ui->queueLock);
+}
 
-  while (1) {
-    ui->request = (char *)malloc(SIZE * sizeof(char));
-    char method[10], route[100];
-    char resource_string[50];
-    unsigned int resource_uint;
+// Start tracing a change tagged by a client, returns its slot plus one
+static uint16_t trace_begin(ThisUI *ui, PluginControl_t *pluginControl,
+                            uint8_t value, uint32_t id,
+                            unsigned long long clientTime) {
+  unsigned int slot =
+      atomic_fetch_add_explicit(&ui->traceNext, 1, memory_order_relaxed) %
+      TRACE_COUNT;
+  Trace_t *trace = &ui->traces[slot];
+  unsigned int sequence =
+      atomic_fetch_add_explicit(&trace->sequence, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&trace->received, 0, memory_order_relaxed);
+  atomic_store_explicit(&trace->enqueued, 0, memory_order_relaxed);
+  atomic_store_explicit(&trace->dequeued, 0, memory_order_relaxed);
+  atomic_store_explicit(&trace->written, 0, memory_order_relaxed);
+  atomic_store_explicit(&trace->echoed, 0, memory_order_relaxed);
+  atomic_store_explicit(&trace->id, id, memory_order_relaxed);
+  atomic_store_explicit(&trace->clientTime, clientTime, memory_order_relaxed);
+  atomic_store_explicit(&trace->index, pluginControl - ui->pluginControls,
+                        memory_order_relaxed);
+  atomic_store_explicit(&trace->value, value, memory_order_relaxed);
+  atomic_store_explicit(&trace->received, now_ns(), memory_order_relaxed);
+  atomic_store_explicit(&trace->sequence, sequence + 2, memory_order_release);
+  return slot + 1;
+}
+
+// Set a control for the request on origin, which is not sent the update.
+// Without an origin connection every worker broadcasts it.
+static void apply_control(ThisUI *ui, PluginControl_t *pluginControl,
+                          uint8_t value, Connection_t *origin,
+                          uint16_t trace) {
+  char text[BROADCAST_LENGTH];
+  if (atomic_exchange_explicit(&pluginControl->value, value,
+                               memory_order_relaxed) != value)
+    atomic_fetch_add_explicit(&ui->stateVersion, 1, memory_order_release);
+  queue_change(ui, pluginControl - ui->pluginControls, value, trace);
+  snprintf(text, sizeof(text), "%s %d", pluginControl->key,
+           control_value(pluginControl));
+  Worker_t *worker = origin != NULL ? origin->worker : NULL;
+  if (worker != NULL)
+    broadcast_control(worker, ui, text, origin);
+  post_notification(ui, pluginControl->key, control_value(pluginControl),
+                    worker);
+}
 
-    ui->clientSocket = accept(ui->serverSocket, NULL, NULL);
-    read(ui->clientSocket, ui->request, SIZE);
+// Set several controls as one change: ui_idle forwards them in the same tick.
+// Without an origin connection every worker broadcasts them.
+static void apply_controls(ThisUI *ui, ControlChange_t *changes,
+                           unsigned int count, Connection_t *origin) {
+  Worker_t *worker = origin != NULL ? origin->worker : NULL;
+  uint64_t queued = now_ns();
+  bool changed = false;
+  for (unsigned int i = 0; i < count; i++) {
+    if (atomic_exchange_explicit(&ui->pluginControls[changes[i].index].value,
+                                 changes[i].value,
+                                 memory_order_relaxed) != changes[i].value)
+      changed = true;
+    changes[i].queued = queued;
+  }
+  if (changed)
+    atomic_fetch_add_explicit(&ui->stateVersion, 1, memory_order_release);
+
+  pthread_mutex_lock(&ui->queueLock);
+  if (atomic_load_explicit(&ui->changesCoalesced, memory_order_relaxed) ||
+      !ring_push_many(&ui->changeRing, changes, count)) {
+    for (unsigned int i = 0; i < count; i++)
+      atomic_store_explicit(&ui->pluginControls[changes[i].index].pending,
+                            changes[i].value, memory_order_relaxed);
+    atomic_store_explicit(&ui->changesCoalesced, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&ui->queueLock);
+
+  for (unsigned int i = 0; i < count; i++) {
+    char text[BROADCAST_LENGTH];
+    PluginControl_t *pluginControl = &ui->pluginControls[changes[i].index];
+    snprintf(text, sizeof(text), "%s %d", pluginControl->key,
+             control_value(pluginControl));
+    if (worker != NULL)
+      broadcast_control(worker, ui, text, origin);
+    post_notification(ui, pluginControl->key, control_value(pluginControl),
+                      worker);
+  }
+}
 
-    sscanf(ui->request, "%s %s", method, route);
+static const char *skip_space(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
+}
 
-    free(ui->request);
+static void bulk_add(BulkBatch_t *batch, PluginControl_t *pluginControl,
+                     uint8_t value) {
+  uint16_t index = pluginControl - batch->ui->pluginControls;
+  if (batch->positions[index] != 0) {
+    batch->changes[batch->positions[index] - 1].value = value;
+    return;
+  }
+  batch->changes[batch->count++] = (ControlChange_t){index, value, 0};
+  batch->positions[index] = batch->count;
+}
 
-    if (strcmp(method, "GET") != 0) {
-      const char response[] =
-          "HTTP/1.1 400 Bad Request\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
-      send(ui->clientSocket, response, strlen(response), 0);
-      continue;
+// Parse {"<key>": <value>, ...}. False when the body is malformed or names
+// an unknown control.
+static bool parse_controls_json(BulkBatch_t *batch, const char *p,
+                                const char *end) {
+  p = skip_space(p, end);
+  if (p == end || *p++ != '{')
+    return false;
+  p = skip_space(p, end);
+  if (p < end && *p == '}')
+    return skip_space(p + 1, end) == end;
+
+  while (true) {
+    if (p == end || *p++ != '"')
+      return false;
+    const char *key = p;
+    while (p < end && *p != '"' && *p != '\\')
+      p++;
+    if (p == end || *p != '"')
+      return false;
+    PluginControl_t *pluginControl = getPluginControl(batch->ui, key, p - key);
+    p = skip_space(p + 1, end);
+    if (pluginControl == NULL || p == end || *p++ != ':')
+      return false;
+    p = skip_space(p, end);
+    unsigned int value = 0;
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (value <= UINT8_MAX)
+        value = value * 10 + (*p - '0');
+      p++;
     }
-
-    if (sscanf(route, "/control/%u/%s", &resource_uint, resource_string) == 2) {
-      PluginControl_t *pluginControl = getPluginControl(ui, resource_string);
-      if (pluginControl != NULL) {
-        pluginControl->value = resource_uint;
-        pluginControl->changed = true;
-        char response[200];
-        sprintf(response,
-                "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\n%d",
-                pluginControl->value);
-        send(ui->clientSocket, response, strlen(response), 0);
-      } else {
-        char *stat404 = "HTTP/1.1 404 Not Found\r\n\r\n";
-        send(ui->clientSocket, stat404, strlen(stat404), 0);
-      }
-      close(ui->clientSocket);
+    if (p == digits)
+      return false;
+    bulk_add(batch, pluginControl, midi_value(value));
+    p = skip_space(p, end);
+    if (p < end && *p == ',') {
+      p = skip_space(p + 1, end);
       continue;
     }
+    if (p == end || *p++ != '}')
+      return false;
+    return skip_space(p, end) == end;
+  }
+}
 
-    if (!strcmp(route, "/controls")) {
-      sendControls(ui);
-      continue;
-    }
+static bool parse_controls(BulkBatch_t *batch, HttpRequest_t *request,
+                           const char *body) {
+  if (!request->binary)
+    return parse_controls_json(batch, body, body + request->bodyLength);
+  if (request->bodyLength % 2)
+    return false;
+  for (size_t i = 0; i < request->bodyLength; i += 2) {
+    uint8_t index = body[i];
+    if (index >= nmbControlKeys - 1)
+      return false;
+    bulk_add(batch, &batch->ui->pluginControls[index],
+             midi_value((uint8_t)body[i + 1]));
+  }
+  return true;
+}
 
-    if (sscanf(route, "/program/%u", &resource_uint) == 1) {
-      ui->currentProgram = resource_uint;
-      ui->programChange = true;
-      // Response is sent from port_event when all changes have been applied
-      continue;
-    }
+// POST /controls with a JSON object, or with (control index, value) byte
+// pairs as application/octet-stream. Nothing is applied unless the whole
+// body is valid. Answers with the applied values.
+static void handle_bulk_controls(ThisUI *ui, Connection_t *conn,
+                                 HttpRequest_t *request) {
+  const char *body = conn->request + request->bodyOffset;
+  BulkBatch_t batch = {.ui = ui};
+  if (!parse_controls(&batch, request, body)) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
 
-    if (!strcmp(route, "/programs")) {
-      char response[200];
-      sprintf(response,
-              "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\n\r\n{");
-      send(ui->clientSocket, response, strlen(response), 0);
-      for (int i = 0; i < 128; i++) {
-        if (i == 0)
-           sprintf(response, "\"%d\": \"%s\"", i, &ui->program[i][0]);
-        else {
-           if (strlen(&ui->program[i][0]) > 0)
-             sprintf(response, ",\"%d\": \"%s\"", i, &ui->program[i][0]);
-           else
-             strcpy(response,"");
-        }
-        send(ui->clientSocket, response, strlen(response), 0);
-      }
-      send(ui->clientSocket, "}", 1, 0);
-      close(ui->clientSocket);
-      continue;
-    }
+  if (batch.count > 0)
+    apply_controls(ui, batch.changes, batch.count, conn);
 
-    if (!strcmp(route, "/"))
-      strcat(route, "index.html");
+  buffer_append(&conn->body, "{", 1);
+  for (unsigned int i = 0; i < batch.count; i++) {
+    PluginControl_t *pluginControl =
+        &ui->pluginControls[batch.changes[i].index];
+    buffer_printf(&conn->body, "%s\"%s\": %d", i ? "," : "",
+                  pluginControl->key, control_value(pluginControl));
+  }
+  buffer_append(&conn->body, "}", 1);
+  conn_respond(conn, "200 OK", "application/json");
+}
 
-    char filepath[200];
-    sprintf(filepath, "%s/%s", ui->static_path, &route[1]);
-    send_file_to_socket(filepath, ui->clientSocket);
-    close(ui->clientSocket);
+// Text frames carry "<key> <value> [<trace id> [<client time>]]", binary
+// frames any number of
+// (control index, value) byte pairs
+static void handle_websocket_message(ThisUI *ui, Connection_t *conn,
+                                     int opcode, const char *payload,
+                                     size_t length) {
+  if (opcode == 0x2) {
+    for (size_t i = 0; i + 1 < length; i += 2) {
+      uint8_t index = payload[i];
+      if (index < nmbControlKeys - 1)
+        apply_control(ui, &ui->pluginControls[index],
+                      midi_value((uint8_t)payload[i + 1]), conn, 0);
+    }
+    return;
   }
-  return NULL;
+
+  char text[BROADCAST_LENGTH];
+  char key[50];
+  int number;
+  if (length >= sizeof(text))
+    return;
+  memcpy(text, payload, length);
+  text[length] = '\0';
+  uint32_t id;
+  unsigned long long clientTime = 0;
+  int fields = sscanf(text, "%49s %d %u %llu", key, &number, &id, &clientTime);
+  if (fields >= 2) {
+    PluginControl_t *pluginControl = getPluginControl(ui, key, strlen(key));
+    uint8_t value = midi_value(number);
+    if (pluginControl != NULL)
+      apply_control(ui, pluginControl, value, conn,
+                    fields >= 3 ? trace_begin(ui, pluginControl, value, id,
+                                              clientTime)
+                                : 0);
+  }
+}
+
+// Decode the complete frames in the request buffer
+static void websocket_process(ThisUI *ui, Connection_t *conn) {
+  while (conn->state == CONN_READING && !conn->closeAfterWrite) {
+    uint8_t *data = (uint8_t *)conn->request;
+    size_t length = data[1] & 0x7F;
+    size_t header = 6;
+
+    if (conn->requestLength < 2)
+      return;
+    if (length == 126) {
+      if (conn->requestLength < 4)
+        return;
+      length = (size_t)data[2] << 8 | data[3];
+      header = 8;
+    }
+    // Clients must mask, and control messages fit in one small frame
+    if (!(data[1] & 0x80) || !(data[0] & 0x80) || length == 127 ||
+        header + length > SIZE - 1) {
+      conn->state = CONN_CLOSING;
+      return;
+    }
+    if (conn->requestLength < header + length)
+      return;
+
+    char *payload = conn->request + header;
+    uint8_t *mask = data + header - 4;
+    for (size_t i = 0; i < length; i++)
+      payload[i] ^= mask[i % 4];
+
+    switch (data[0] & 0x0F) {
+    case 0x1: // text
+    case 0x2: // binary
+      handle_websocket_message(ui, conn, data[0] & 0x0F, payload, length);
+      break;
+    case 0x8: // close
+      websocket_send(conn, 0x8, payload, length < 2 ? length : 2);
+      conn->closeAfterWrite = true;
+      break;
+    case 0x9: // ping
+      websocket_send(conn, 0xA, payload, length);
+      break;
+    case 0xA: // pong
+      break;
+    default:
+      conn->state = CONN_CLOSING;
+      return;
+    }
+
+    conn->requestLength -= header + length;
+    memmove(conn->request, conn->request + header + length,
+            conn->requestLength);
+    conn->request[conn->requestLength] = '\0';
+  }
+}
+
+static void websocket_upgrade(Connection_t *conn, HttpRequest_t *request) {
+  // Clients of another version are told the one served, RFC 6455 4.4
+  if (request->websocketVersion == NULL ||
+      strcmp(request->websocketVersion, "13") != 0) {
+    if (!buffer_printf(&conn->response,
+                       "HTTP/1.1 400 Bad Request\r\n"
+                       "Sec-WebSocket-Version: 13\r\nContent-Length: 0\r\n"
+                       "%s\r\n",
+                       conn->keepAlive ? "" : "Connection: close\r\n"))
+      conn->state = CONN_CLOSING;
+    if (!conn->keepAlive)
+      conn->closeAfterWrite = true;
+    return;
+  }
+  if (!request->upgrade || !request->connectionUpgrade ||
+      request->websocketKey == NULL || strlen(request->websocketKey) > 60) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
+
+  char key[64 + sizeof(WEBSOCKET_GUID)];
+  uint8_t digest[20];
+  char accept[29];
+  sprintf(key, "%s%s", request->websocketKey, WEBSOCKET_GUID);
+  sha1((uint8_t *)key, strlen(key), digest);
+  base64_encode(digest, sizeof(digest), accept);
+
+  if (!buffer_printf(&conn->response,
+                     "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                     "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+                     accept)) {
+    conn->state = CONN_CLOSING;
+    return;
+  }
+  conn->stream = STREAM_WEBSOCKET;
+  conn->nextStream = conn->worker->streamConnections;
+  conn->worker->streamConnections = conn;
+}
+
+static void event_stream_open(ThisUI *ui, Connection_t *conn) {
+  if (!buffer_printf(&conn->response,
+                     "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n"
+                     "Content-Type: text/event-stream\r\n"
+                     "Cache-Control: no-cache\r\n\r\n")) {
+    conn->state = CONN_CLOSING;
+    return;
+  }
+  conn->stream = STREAM_EVENTS;
+  conn->nextStream = conn->worker->streamConnections;
+  conn->worker->streamConnections = conn;
+  stream_state(ui, conn);
+}
+
+static const char *mime_type(const char *path) {
+  static const char *types[][2] = {
+      {".html", "text/html; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".mjs", "text/javascript; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".json", "application/json"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".ico", "image/x-icon"},
+      {".wasm", "application/wasm"},
+      {".woff2", "font/woff2"},
+      {".txt", "text/plain; charset=utf-8"},
+      {NULL, NULL}};
+  const char *extension = strrchr(path, '.');
+  for (int i = 0; extension != NULL && types[i][0] != NULL; i++) {
+    if (!strcasecmp(extension, types[i][0]))
+      return types[i][1];
+  }
+  return "application/octet-stream";
+}
+
+static bool read_file(const char *path, char *body, size_t length) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  bool ok = fread(body, 1, length, file) == length;
+  fclose(file);
+  return ok;
+}
+
+// Load the files below directory, served under route
+static void load_static_files(const char *directory, const char *route) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL)
+    return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    char path[PATH_MAX];
+    char entryRoute[100];
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >=
+            (int)sizeof(path) ||
+        snprintf(entryRoute, sizeof(entryRoute), "%s/%s", route,
+                 entry->d_name) >= (int)sizeof(entryRoute) ||
+        stat(path, &st) < 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      load_static_files(path, entryRoute);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+      continue;
+
+    StaticFile_t *file = calloc(1, sizeof(StaticFile_t));
+    if (file == NULL)
+      break;
+    strcpy(file->route, entryRoute);
+    strcpy(file->path, path);
+    file->length = st.st_size;
+    if (file->length <= MAX_CACHED_FILE) {
+      file->body = malloc(file->length ? file->length : 1);
+      if (file->body == NULL || !read_file(path, file->body, file->length)) {
+        free(file->body);
+        free(file);
+        continue;
+      }
+    }
+    file->mimeType = mime_type(path);
+    file->mtime = st.st_mtime;
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%zx\"",
+             (unsigned long)st.st_mtime, file->length);
+    file->next = server.staticFiles;
+    server.staticFiles = file;
+  }
+  closedir(dir);
+}
+
+static StaticFile_t *find_static_file(const char *route, size_t length) {
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    if (strlen(file->route) == length && !strncmp(file->route, route, length))
+      return file;
+  }
+  return NULL;
+}
+
+// Attach .gz/.br sidecars to the file they compress, then build the header
+// blocks sent with every reply
+static void prepare_static_files(void) {
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    size_t length = strlen(file->route);
+    if (length < 4)
+      continue;
+    const char *suffix = file->route + length - 3;
+    bool gzip = !strcmp(suffix, ".gz");
+    if (!gzip && strcmp(suffix, ".br"))
+      continue;
+    StaticFile_t *original = find_static_file(file->route, length - 3);
+    if (original == NULL)
+      continue;
+    if (gzip)
+      original->gzip = file;
+    else
+      original->brotli = file;
+    file->encoding = gzip ? "gzip" : "br";
+    file->mimeType = original->mimeType;
+  }
+
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    char lastModified[40];
+    struct tm tm;
+    strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&file->mtime, &tm));
+    const char *vary = file->encoding || file->gzip || file->brotli
+                           ? "Vary: Accept-Encoding\r\n"
+                           : "";
+    file->notModifiedLength = snprintf(
+        file->notModified, sizeof(file->notModified),
+        "HTTP/1.1 304 Not Modified\r\nAccess-Control-Allow-Origin: *\r\n"
+        "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n%s",
+        file->etag, lastModified, vary);
+    file->headerLength = snprintf(
+        file->headers, sizeof(file->headers),
+        "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n"
+        "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s%s"
+        "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n%s",
+        file->mimeType, file->length, file->encoding ? "Content-Encoding: " : "",
+        file->encoding ? file->encoding : "", file->encoding ? "\r\n" : "",
+        file->etag, lastModified, vary);
+  }
+}
+
+static void free_static_files(void) {
+  while (server.staticFiles != NULL) {
+    StaticFile_t *file = server.staticFiles;
+    server.staticFiles = file->next;
+    free(file->body);
+    free(file);
+  }
+}
+
+// Whether an If-None-Match list names etag or is "*". Tags are compared
+// whole, so weak W/ tags and substrings of others do not match.
+static bool etag_listed(const char *list, const char *etag) {
+  size_t length = strlen(etag);
+  while (*list != '\0') {
+    list += strspn(list, " \t,");
+    size_t tag = strcspn(list, ",");
+    size_t trimmed = tag;
+    while (trimmed > 0 &&
+           (list[trimmed - 1] == ' ' || list[trimmed - 1] == '\t'))
+      trimmed--;
+    if ((trimmed == length && !strncmp(list, etag, length)) ||
+        (trimmed == 1 && *list == '*'))
+      return true;
+    list += tag;
+  }
+  return false;
+}
+
+// Only files found at startup are served, so routes cannot escape
+// static_path
+static void send_static_file(Connection_t *conn, HttpRequest_t *request,
+                             const char *route) {
+  const StaticFile_t *file = find_static_file(route, strlen(route));
+  if (file == NULL || file->encoding != NULL) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+  if (request->acceptBrotli && file->brotli != NULL)
+    file = file->brotli;
+  else if (request->acceptGzip && file->gzip != NULL)
+    file = file->gzip;
+
+  // If-None-Match takes precedence over If-Modified-Since
+  bool notModified =
+      request->ifNoneMatch != NULL
+          ? etag_listed(request->ifNoneMatch, file->etag)
+          : request->ifModifiedSince != -1 &&
+                file->mtime <= request->ifModifiedSince;
+  if (notModified) {
+    if (!buffer_append(&conn->response, file->notModified,
+                       file->notModifiedLength) ||
+        !buffer_printf(&conn->response, "%s\r\n",
+                       conn->keepAlive ? "" : "Connection: close\r\n"))
+      conn->state = CONN_CLOSING;
+    if (!conn->keepAlive)
+      conn->closeAfterWrite = true;
+    return;
+  }
+
+  if (file->body == NULL) {
+    conn->fileFd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (conn->fileFd < 0) {
+      conn_respond(conn, "404 Not Found", NULL);
+      return;
+    }
+  }
+  if (!buffer_append(&conn->response, file->headers, file->headerLength) ||
+      !buffer_printf(&conn->response, "%s\r\n",
+                     conn->keepAlive ? "" : "Connection: close\r\n"))
+    conn->state = CONN_CLOSING;
+  conn->file = file;
+  conn->bodySent = 0;
+  if (!conn->keepAlive)
+    conn->closeAfterWrite = true;
+}
+
+static void release_body(Connection_t *conn) {
+  if (conn->fileFd >= 0)
+    close(conn->fileFd);
+  conn->fileFd = -1;
+  conn->file = NULL;
+  snapshot_release(conn->snapshot);
+  conn->snapshot = NULL;
+  conn->bodySent = 0;
+}
+
+// Body sent from memory after the queued response, NULL when there is none
+// or it goes out with sendfile
+static const char *memory_body(Connection_t *conn, size_t *length) {
+  if (conn->snapshot != NULL) {
+    *length = conn->snapshot->length;
+    return conn->snapshot->data;
+  }
+  if (conn->file != NULL && conn->file->body != NULL) {
+    *length = conn->file->length;
+    return conn->file->body;
+  }
+  return NULL;
+}
+
+// Exported with the same bounds on every scrape, each power of two from
+// about 1 us, so the series stay stable for rate() and histogram_quantile()
+static void histogram_text(Buffer_t *out, const char *name, const char *help,
+                           Histogram_t *histogram) {
+  buffer_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    total += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    unsigned int last = (1 << HISTOGRAM_SUB_BITS) - 1;
+    if ((i & last) != last || histogram_bound(i) < 1000)
+      continue;
+    buffer_printf(out, "%s_bucket{le=\"%.9f\"} %llu\n", name,
+                  histogram_bound(i) / 1e9, (unsigned long long)total);
+  }
+  total += atomic_load_explicit(&histogram->counts[HISTOGRAM_BUCKETS - 1],
+                                memory_order_relaxed);
+  buffer_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)total);
+  buffer_printf(
+      out, "%s_sum %.9f\n%s_count %llu\n", name,
+      atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e9, name,
+      (unsigned long long)total);
+}
+
+// Prometheus text exposition format. Connections, bytes sent and parse time
+// are the server's, shared by all instances.
+static void metrics_text(ThisUI *ui, Buffer_t *out) {
+  Metrics_t *metrics = &ui->metrics;
+  buffer_printf(out, "# HELP uiweb_http_requests_total HTTP requests by "
+                     "route.\n# TYPE uiweb_http_requests_total counter\n");
+  for (unsigned int i = 0; i < ROUTE_LABELS; i++)
+    buffer_printf(out, "uiweb_http_requests_total{route=\"%s\"} %llu\n",
+                  routeLabels[i][1],
+                  (unsigned long long)atomic_load_explicit(
+                      &metrics->requests[i], memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_not_found_total Replies with status 404.\n"
+                "# TYPE uiweb_http_not_found_total counter\n"
+                "uiweb_http_not_found_total %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->notFound, memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_sent_bytes_total Bytes written to clients.\n"
+                "# TYPE uiweb_http_sent_bytes_total counter\n"
+                "uiweb_http_sent_bytes_total %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &server.metrics.bytesSent, memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_connections Open client connections.\n"
+                "# TYPE uiweb_http_connections gauge\n"
+                "uiweb_http_connections %lld\n",
+                (long long)atomic_load_explicit(&server.metrics.connections,
+                                                memory_order_relaxed));
+  buffer_printf(out, "# HELP uiweb_osc_messages_total OSC messages received, "
+                     "rejected ones are counted for the server.\n"
+                     "# TYPE uiweb_osc_messages_total counter\n");
+  buffer_printf(out,
+                "uiweb_osc_messages_total{result=\"applied\"} %llu\n"
+                "uiweb_osc_messages_total{result=\"rejected\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->oscApplied, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(
+                    &server.metrics.oscRejected, memory_order_relaxed));
+  buffer_printf(out, "# HELP uiweb_shm_records_total Control channel records "
+                     "consumed.\n"
+                     "# TYPE uiweb_shm_records_total counter\n");
+  buffer_printf(out,
+                "uiweb_shm_records_total{result=\"applied\"} %llu\n"
+                "uiweb_shm_records_total{result=\"rejected\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelApplied, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelRejected, memory_order_relaxed));
+  buffer_printf(out, "uiweb_shm_records_total{result=\"overrun\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelOverrun, memory_order_relaxed));
+  histogram_text(out, "uiweb_request_parse_seconds",
+                 "Time to parse a request header block.",
+                 &server.metrics.parseTime);
+  histogram_text(out, "uiweb_change_queued_seconds",
+                 "Time a control change waits for ui_idle.",
+                 &metrics->queueTime);
+  histogram_text(out, "uiweb_port_event_seconds",
+                 "Time to decode a port_event from the plugin.",
+                 &metrics->portEventTime);
+}
+
+// Value of name in a query string, up to the next '&'
+static const char *query_value(const char *query, const char *name) {
+  size_t length = strlen(name);
+  while (query != NULL) {
+    if (!strncmp(query, name, length) && query[length] == '=')
+      return query + length + 1;
+    query = strchr(query, '&');
+    if (query != NULL)
+      query++;
+  }
+  return NULL;
+}
+
+// Stages not reached yet, or stamped out of order by a slot that was
+// reused meanwhile, are left out
+static void trace_stage(Buffer_t *out, bool chrome, const char *name,
+                        uint32_t id, uint64_t from, uint64_t to, bool *first) {
+  if (from == 0 || to < from)
+    return;
+  if (chrome) {
+    buffer_printf(out,
+                  "%s{\"name\": \"%s\", \"cat\": \"control\", \"ph\": "
+                  "\"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+                  "\"dur\": %.3f}",
+                  *first ? "" : ",", name, id, from / 1e3,
+                  (to - from) / 1e3);
+    *first = false;
+  } else {
+    buffer_printf(out, ", \"%sUs\": %.3f", name, (to - from) / 1e3);
+  }
+}
+
+// The last TRACE_COUNT traced changes, oldest first: durations of each
+// stage, or Chrome trace events (chrome://tracing, Perfetto)
+static void traces_json(ThisUI *ui, Buffer_t *out, bool chrome) {
+  buffer_printf(out, chrome ? "{\"traceEvents\": [" : "[");
+  bool first = true;
+  unsigned int next =
+      atomic_load_explicit(&ui->traceNext, memory_order_relaxed);
+  for (unsigned int i = next - TRACE_COUNT; i != next; i++) {
+    Trace_t *trace = &ui->traces[i % TRACE_COUNT];
+    unsigned int sequence =
+        atomic_load_explicit(&trace->sequence, memory_order_acquire);
+    if (sequence & 1)
+      continue;
+    uint32_t id = atomic_load_explicit(&trace->id, memory_order_relaxed);
+    unsigned long long clientTime =
+        atomic_load_explicit(&trace->clientTime, memory_order_relaxed);
+    uint16_t index = atomic_load_explicit(&trace->index, memory_order_relaxed);
+    uint8_t value = atomic_load_explicit(&trace->value, memory_order_relaxed);
+    uint64_t received =
+        atomic_load_explicit(&trace->received, memory_order_relaxed);
+    uint64_t enqueued =
+        atomic_load_explicit(&trace->enqueued, memory_order_relaxed);
+    uint64_t dequeued =
+        atomic_load_explicit(&trace->dequeued, memory_order_relaxed);
+    uint64_t written =
+        atomic_load_explicit(&trace->written, memory_order_relaxed);
+    uint64_t echoed = atomic_load_explicit(&trace->echoed, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (received == 0 || index >= nmbControlKeys - 1 ||
+        atomic_load_explicit(&trace->sequence, memory_order_relaxed) !=
+            sequence)
+      continue;
+
+    if (!chrome) {
+      buffer_printf(out,
+                    "%s{\"id\": %u, \"clientTime\": %llu, \"key\": \"%s\", "
+                    "\"value\": %d",
+                    first ? "" : ",", id, clientTime,
+                    ui->pluginControls[index].key, value);
+      first = false;
+    }
+    trace_stage(out, chrome, "server", id, received, enqueued, &first);
+    trace_stage(out, chrome, "ring", id, enqueued, dequeued, &first);
+    trace_stage(out, chrome, "idle", id, dequeued, written, &first);
+    trace_stage(out, chrome, "plugin", id, written, echoed, &first);
+    if (!chrome)
+      buffer_append(out, "}", 1);
+  }
+  buffer_printf(out, chrome ? "], \"displayTimeUnit\": \"ms\"}" : "]");
+}
+
+static void count_request(ThisUI *ui, const char *route) {
+  for (unsigned int i = 0; i < ROUTE_LABELS; i++) {
+    if (!strncmp(route, routeLabels[i][0], strlen(routeLabels[i][0]))) {
+      metric_add(&ui->metrics.requests[i], 1);
+      return;
+    }
+  }
+}
+
+static void handle_request(ThisUI *ui, Connection_t *conn,
+                           HttpRequest_t *request) {
+  char *route = request->route;
+  char resource_string[50];
+  int resource_int;
+
+  char *query = strchr(route, '?');
+  if (query != NULL)
+    *query++ = '\0';
+
+  count_request(ui, route);
+
+  if (!strcmp(request->method, "POST") && !strcmp(route, "/controls")) {
+    handle_bulk_controls(ui, conn, request);
+    return;
+  }
+
+  if (strcmp(request->method, "GET") != 0) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
+
+  if (sscanf(route, "/control/%d/%49s", &resource_int, resource_string) ==
+      2) {
+    PluginControl_t *pluginControl =
+        getPluginControl(ui, resource_string, strlen(resource_string));
+    if (pluginControl != NULL) {
+      uint16_t trace = 0;
+      const char *id = query_value(query, "trace");
+      if (id != NULL) {
+        const char *clientTime = query_value(query, "t");
+        trace = trace_begin(ui, pluginControl, midi_value(resource_int),
+                            atol(id),
+                            clientTime ? strtoull(clientTime, NULL, 10) : 0);
+      }
+      apply_control(ui, pluginControl, midi_value(resource_int), conn, trace);
+      buffer_printf(&conn->body, "%d", control_value(pluginControl));
+      conn_respond(conn, "200 OK", NULL);
+    } else {
+      conn_respond(conn, "404 Not Found", NULL);
+    }
+    return;
+  }
+
+  if (!strcmp(route, "/controls")) {
+    sendControls(ui, conn);
+    return;
+  }
+
+  if (!strcmp(route, "/ws")) {
+    websocket_upgrade(conn, request);
+    return;
+  }
+
+  if (!strcmp(route, "/events")) {
+    event_stream_open(ui, conn);
+    return;
+  }
+
+  if (sscanf(route, "/program/%d", &resource_int) == 1) {
+    queue_change(ui, PROGRAM_CHANGE, midi_value(resource_int), 0);
+    // Response is sent when port_event reports that all changes have been
+    // applied. Pipelined requests behind this one wait for it.
+    conn->state = CONN_WAITING;
+    conn->nextWaiting = conn->worker->waitingConnections;
+    conn->worker->waitingConnections = conn;
+    return;
+  }
+
+  if (!strcmp(route, "/programs")) {
+    sendPrograms(ui, conn);
+    return;
+  }
+
+  if (!strcmp(route, "/metrics")) {
+    metrics_text(ui, &conn->body);
+    conn_respond(conn, "200 OK", "text/plain; version=0.0.4");
+    return;
+  }
+
+  if (!strcmp(route, "/traces") || !strcmp(route, "/traces/chrome")) {
+    traces_json(ui, &conn->body, route[7] == '/');
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  send_static_file(conn, request, strcmp(route, "/") ? route : "/index.html");
+}
+
+// Caller holds server.lock
+static ThisUI *find_instance(const char *name, size_t length) {
+  for (ThisUI *ui = server.instances; ui != NULL; ui = ui->nextInstance) {
+    if (strlen(ui->name) == length && !strncmp(ui->name, name, length))
+      return ui;
+  }
+  return NULL;
+}
+
+static void instances_json(Buffer_t *out) {
+  buffer_append(out, "[", 1);
+  pthread_mutex_lock(&server.lock);
+  for (ThisUI *ui = server.instances; ui != NULL; ui = ui->nextInstance)
+    buffer_printf(out, "%s\"%s\"", ui == server.instances ? "" : ",",
+                  ui->name);
+  pthread_mutex_unlock(&server.lock);
+  buffer_append(out, "]", 1);
+}
+
+// Requests under /i/<name>/ go to that instance and any other route to the
+// instance whose Unix-domain socket the client connected to, or else to the
+// first one, so a process with a single instance is served as before
+static void route_request(Connection_t *conn, HttpRequest_t *request) {
+  char *route = request->route;
+  if (!strcmp(request->method, "GET") && !strcmp(route, "/instances")) {
+    instances_json(&conn->body);
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  bool prefixed = !strncmp(route, "/i/", 3);
+  size_t length = prefixed ? strcspn(route + 3, "/?") : 0;
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = prefixed                ? find_instance(route + 3, length)
+               : conn->home != NULL ? conn->home
+                                    : server.instances;
+  pthread_mutex_unlock(&server.lock);
+  conn->ui = ui;
+  conn->metrics = ui != NULL ? &ui->metrics : &server.metrics;
+  if (ui == NULL) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+
+  if (prefixed) {
+    route += 3 + length;
+    if (*route != '/') {
+      // The page's relative URLs resolve against the trailing slash
+      if (!buffer_printf(&conn->response,
+                         "HTTP/1.1 301 Moved Permanently\r\n"
+                         "Location: /i/%s/%s\r\nContent-Length: 0\r\n%s\r\n",
+                         ui->name, route,
+                         conn->keepAlive ? "" : "Connection: close\r\n"))
+        conn->state = CONN_CLOSING;
+      if (!conn->keepAlive)
+        conn->closeAfterWrite = true;
+      return;
+    }
+    request->route = route;
+  }
+  handle_request(ui, conn, request);
+}
+
+static uint32_t osc_uint32(const uint8_t *data) {
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+         (uint32_t)data[2] << 8 | data[3];
+}
+
+// Length of the OSC string at data with its padding, 0 when it does not end
+// within size
+static size_t osc_string(const uint8_t *data, size_t size) {
+  size_t length = strnlen((const char *)data, size);
+  size_t padded = (length + 4) & ~(size_t)3;
+  return length < size && padded <= size ? padded : 0;
+}
+
+// The first argument as a number, false when there is none
+static bool osc_number(const char *types, const uint8_t *args, size_t size,
+                       double *number) {
+  char type = types[0] == ',' ? types[1] : '\0';
+  if ((type == 'i' || type == 'f') && size >= 4) {
+    uint32_t word = osc_uint32(args);
+    float single;
+    memcpy(&single, &word, sizeof(single));
+    *number = type == 'i' ? (int32_t)word : single;
+    return true;
+  }
+  if ((type == 'h' || type == 'd') && size >= 8) {
+    uint64_t word = (uint64_t)osc_uint32(args) << 32 | osc_uint32(args + 4);
+    double wide;
+    memcpy(&wide, &word, sizeof(wide));
+    *number = type == 'h' ? (int64_t)word : wide;
+    return true;
+  }
+  if (type == 'T' || type == 'F') {
+    *number = type == 'T';
+    return true;
+  }
+  return false;
+}
+
+// Apply the decoded changes, those of each instance as one
+static void osc_flush(OscBatch_t *batch) {
+  ControlChange_t changes[OSC_MAX_CHANGES];
+  for (unsigned int i = 0; i < batch->count; i++) {
+    ThisUI *ui = batch->ui[i];
+    if (ui == NULL)
+      continue;
+    unsigned int count = 0;
+    for (unsigned int j = i; j < batch->count; j++) {
+      if (batch->ui[j] == ui) {
+        changes[count++] = batch->changes[j];
+        batch->ui[j] = NULL;
+      }
+    }
+    apply_controls(ui, changes, count, NULL);
+  }
+  batch->count = 0;
+}
+
+// /<instance>/<control key> or /<instance>/program with a number, which is
+// rounded and clamped to 0..127
+static bool osc_message(OscBatch_t *batch, const uint8_t *data, size_t size) {
+  size_t addressLength = osc_string(data, size);
+  if (addressLength == 0 || data[0] != '/')
+    return false;
+  size_t typesLength = osc_string(data + addressLength, size - addressLength);
+  double number;
+  if (typesLength == 0 ||
+      !osc_number((const char *)data + addressLength,
+                  data + addressLength + typesLength,
+                  size - addressLength - typesLength, &number))
+    return false;
+
+  const char *name = (const char *)data + 1;
+  const char *key = strchr(name, '/');
+  if (key == NULL)
+    return false;
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = find_instance(name, key - name);
+  pthread_mutex_unlock(&server.lock);
+  if (ui == NULL)
+    return false;
+  key++;
+  uint8_t value = midi_value(number);
+
+  if (!strcmp(key, "program")) {
+    osc_flush(batch); // changes ahead of it in a bundle go first
+    queue_change(ui, PROGRAM_CHANGE, value, 0);
+  } else {
+    PluginControl_t *pluginControl = getPluginControl(ui, key, strlen(key));
+    if (pluginControl == NULL)
+      return false;
+    if (batch->count == OSC_MAX_CHANGES)
+      osc_flush(batch);
+    batch->ui[batch->count] = ui;
+    batch->changes[batch->count++] =
+        (ControlChange_t){pluginControl - ui->pluginControls, value, 0};
+  }
+  metric_add(&ui->metrics.oscApplied, 1);
+  return true;
+}
+
+// A message or a bundle of packets. Time tags are not honoured, bundles are
+// applied as they arrive.
+static void osc_packet(OscBatch_t *batch, const uint8_t *data, size_t size,
+                       int depth) {
+  if (size < 16 || memcmp(data, "#bundle", 8) != 0) {
+    if (!osc_message(batch, data, size))
+      metric_add(&server.metrics.oscRejected, 1);
+    return;
+  }
+  if (depth == OSC_MAX_DEPTH) {
+    metric_add(&server.metrics.oscRejected, 1);
+    return;
+  }
+  for (size_t at = 16; at + 4 <= size;) {
+    uint32_t length = osc_uint32(data + at);
+    at += 4;
+    if (length > size - at || length % 4 != 0) {
+      metric_add(&server.metrics.oscRejected, 1);
+      return;
+    }
+    osc_packet(batch, data + at, length, depth + 1);
+    at += length;
+  }
+}
+
+// Apply every datagram waiting on the OSC socket
+static void osc_receive(void) {
+  uint8_t packet[OSC_PACKET_SIZE];
+  OscBatch_t batch = {.count = 0};
+  while (1) {
+    ssize_t n = recv(server.oscSocket, packet, sizeof(packet), MSG_TRUNC);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if ((size_t)n > sizeof(packet) || n % 4 != 0) {
+      metric_add(&server.metrics.oscRejected, 1);
+      continue;
+    }
+    osc_packet(&batch, packet, n, 0);
+    osc_flush(&batch);
+  }
+}
+
+// Whether an Accept-Encoding value allows coding, honouring q=0 and "*"
+static bool accepts_encoding(const char *value, const char *coding) {
+  size_t length = strlen(coding);
+  const char *end = value + strlen(value);
+  bool wildcard = false;
+  while (value < end) {
+    value += strspn(value, " \t,");
+    size_t token = strcspn(value, " \t,;");
+    bool named = token == length && !strncasecmp(value, coding, length);
+    if (named || (token == 1 && *value == '*')) {
+      const char *q = value + token;
+      q += strspn(q, " \t");
+      bool allowed = true;
+      if (*q == ';') {
+        q += 1 + strspn(q + 1, " \t");
+        allowed = strncasecmp(q, "q=", 2) != 0 || strtod(q + 2, NULL) > 0;
+      }
+      if (named)
+        return allowed;
+      wildcard = allowed;
+    }
+    value += strcspn(value, ",");
+  }
+  return wildcard;
+}
+
+// Whether a comma separated header value lists token, in any case
+static bool lists_token(const char *value, const char *token) {
+  size_t length = strlen(token);
+  while (*value != '\0') {
+    value += strspn(value, " \t,");
+    size_t item = strcspn(value, " \t,");
+    if (item == length && !strncasecmp(value, token, length))
+      return true;
+    value += item;
+  }
+  return false;
+}
+
+static int reject(HttpRequest_t *request, const char *status) {
+  request->error = status;
+  return -1;
+}
+
+static bool header_is(const char *name, size_t length, const char *expected) {
+  return length == strlen(expected) && !strncasecmp(name, expected, length);
+}
+
+// Position of the CR ending the line at p, NULL when it is not CRLF
+static char *line_end(char *p, char *limit) {
+  char *cr = memchr(p, '\r', limit - p);
+  return cr != NULL && cr + 1 < limit && cr[1] == '\n' ? cr : NULL;
+}
+
+// Parse the request line and header fields, end being the blank line
+static int parse_head(Connection_t *conn, HttpRequest_t *request, char *end) {
+  char *limit = end + 2;
+  char *line = conn->request;
+  char *lineEnd = line_end(line, limit);
+  if (lineEnd == NULL)
+    return reject(request, "400 Bad Request");
+
+  char *space = memchr(line, ' ', lineEnd - line);
+  if (space == NULL || space == line || space - line > MAX_METHOD)
+    return reject(request, "400 Bad Request");
+  request->method = line;
+  *space = '\0';
+
+  char *route = space + 1;
+  space = memchr(route, ' ', lineEnd - route);
+  if (space == NULL || *route != '/')
+    return reject(request, "400 Bad Request");
+  request->route = route;
+  *space = '\0';
+
+  char *version = space + 1;
+  if (lineEnd - version != 8 || strncmp(version, "HTTP/1.", 7) != 0)
+    return reject(request, "505 HTTP Version Not Supported");
+  request->keepAlive = version[7] != '0';
+
+  size_t headerLength = end + 4 - conn->request;
+  size_t contentLength = 0;
+  bool hasLength = false;
+  int headers = 0;
+  for (line = lineEnd + 2; line < limit; line = lineEnd + 2) {
+    lineEnd = line_end(line, limit);
+    if (lineEnd == NULL)
+      return reject(request, "400 Bad Request");
+    if (++headers > MAX_HEADERS)
+      return reject(request, "431 Request Header Fields Too Large");
+    char *colon = memchr(line, ':', lineEnd - line);
+    if (colon == NULL || colon == line)
+      return reject(request, "400 Bad Request");
+    size_t nameLength = colon - line;
+
+    char *value = colon + 1;
+    while (value < lineEnd && (*value == ' ' || *value == '\t'))
+      value++;
+    char *valueEnd = lineEnd;
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+      valueEnd--;
+    *valueEnd = '\0';
+
+    if (header_is(line, nameLength, "Connection")) {
+      if (!strcasecmp(value, "close"))
+        request->keepAlive = false;
+      else if (!strcasecmp(value, "keep-alive"))
+        request->keepAlive = true;
+      request->connectionUpgrade = lists_token(value, "upgrade");
+    } else if (header_is(line, nameLength, "Content-Length")) {
+      char *digitsEnd;
+      unsigned long long length = strtoull(value, &digitsEnd, 10);
+      // Repeated with another value the body's end is ambiguous
+      if (*value < '0' || *value > '9' || *digitsEnd != '\0' ||
+          (hasLength && length != contentLength))
+        return reject(request, "400 Bad Request");
+      if (length > SIZE - 1 - headerLength)
+        return reject(request, "413 Content Too Large");
+      contentLength = length;
+      hasLength = true;
+    } else if (header_is(line, nameLength, "Transfer-Encoding")) {
+      return reject(request, "501 Not Implemented");
+    } else if (header_is(line, nameLength, "Content-Type")) {
+      request->binary = !strncasecmp(value, "application/octet-stream", 24);
+    } else if (header_is(line, nameLength, "If-None-Match")) {
+      request->ifNoneMatch = value;
+    } else if (header_is(line, nameLength, "If-Modified-Since")) {
+      struct tm tm = {0};
+      if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+        request->ifModifiedSince = timegm(&tm);
+    } else if (header_is(line, nameLength, "Accept-Encoding")) {
+      request->acceptGzip = accepts_encoding(value, "gzip");
+      request->acceptBrotli = accepts_encoding(value, "br");
+    } else if (header_is(line, nameLength, "Upgrade")) {
+      request->upgrade = lists_token(value, "websocket");
+    } else if (header_is(line, nameLength, "Sec-WebSocket-Key")) {
+      request->websocketKey = value;
+    } else if (header_is(line, nameLength, "Sec-WebSocket-Version")) {
+      request->websocketVersion = value;
+    }
+  }
+
+  request->bodyOffset = headerLength;
+  request->bodyLength = contentLength;
+  request->length = headerLength + contentLength;
+  return 1;
+}
+
+// Returns 1 when the request at the start of the buffer is complete, 0 when
+// more bytes are needed and -1 when it cannot be served. The header block
+// is parsed once, as soon as it is complete; reads after that only extend
+// the search for its end or wait for the body.
+static int parse_request(Connection_t *conn) {
+  HttpRequest_t *request = &conn->current;
+  if (!conn->headersParsed) {
+    size_t from = conn->scanned > 3 ? conn->scanned - 3 : 0;
+    char *end = memmem(conn->request + from, conn->requestLength - from,
+                       "\r\n\r\n", 4);
+    if (end == NULL) {
+      conn->scanned = conn->requestLength;
+      return conn->requestLength >= SIZE - 1
+                 ? reject(request, "431 Request Header Fields Too Large")
+                 : 0;
+    }
+    *request = (HttpRequest_t){.ifModifiedSince = -1};
+    uint64_t start = now_ns();
+    if (parse_head(conn, request, end) < 0)
+      return -1;
+    histogram_record(&server.metrics.parseTime, now_ns() - start);
+    conn->headersParsed = true;
+  }
+  return request->length <= conn->requestLength;
+}
+
+// Answer every complete request in the buffer, in order
+static void conn_process(Connection_t *conn) {
+  while (conn->state == CONN_READING && !conn->closeAfterWrite &&
+         conn->file == NULL && conn->snapshot == NULL) {
+    if (conn->stream == STREAM_WEBSOCKET) {
+      websocket_process(conn->ui, conn);
+      return;
+    }
+    if (conn->stream == STREAM_EVENTS) {
+      conn->requestLength = 0;
+      return;
+    }
+
+    HttpRequest_t *request = &conn->current;
+    int parsed = parse_request(conn);
+    if (parsed == 0)
+      return;
+    if (parsed < 0) {
+      conn->keepAlive = false;
+      conn_respond(conn, request->error, NULL);
+      return;
+    }
+
+    conn->keepAlive = request->keepAlive;
+    route_request(conn, request);
+
+    conn->requestLength -= request->length;
+    memmove(conn->request, conn->request + request->length,
+            conn->requestLength);
+    conn->request[conn->requestLength] = '\0';
+    conn->headersParsed = false;
+    conn->scanned = 0;
+  }
+}
+
+// Connections and their arenas are allocated once, so serving requests
+// needs no heap traffic unless a response outgrows its arena
+static bool pool_init(Worker_t *worker) {
+  worker->connections = calloc(MAX_CONNECTIONS, sizeof(Connection_t));
+  worker->arenas = malloc(MAX_CONNECTIONS * ARENA_SIZE);
+  if (worker->connections == NULL || worker->arenas == NULL)
+    return false;
+  for (int i = MAX_CONNECTIONS - 1; i >= 0; i--) {
+    Connection_t *conn = &worker->connections[i];
+    char *arena = worker->arenas + i * ARENA_SIZE;
+    conn->body = (Buffer_t){arena, 0, ARENA_SIZE / 4, arena, ARENA_SIZE / 4};
+    arena += ARENA_SIZE / 4;
+    conn->response = (Buffer_t){arena, 0, ARENA_SIZE - ARENA_SIZE / 4, arena,
+                                ARENA_SIZE - ARENA_SIZE / 4};
+    conn->socket = -1;
+    conn->worker = worker;
+    conn->fileFd = -1;
+    conn->nextFree = worker->freeConnections;
+    worker->freeConnections = conn;
+  }
+  return true;
+}
+
+static void pool_free(Worker_t *worker) {
+  for (int i = 0; worker->connections != NULL && i < MAX_CONNECTIONS; i++) {
+    Connection_t *conn = &worker->connections[i];
+    if (conn->socket >= 0)
+      close(conn->socket);
+    release_body(conn);
+    buffer_recycle(&conn->body);
+    buffer_recycle(&conn->response);
+  }
+  free(worker->connections);
+  free(worker->arenas);
+  worker->connections = NULL;
+  worker->arenas = NULL;
+  worker->freeConnections = NULL;
+  worker->streamConnections = NULL;
+  worker->waitingConnections = NULL;
+  worker->closedConnections = NULL;
+}
+
+static Connection_t *conn_acquire(Worker_t *worker, int socket) {
+  Connection_t *conn = worker->freeConnections;
+  if (conn == NULL)
+    return NULL;
+  worker->freeConnections = conn->nextFree;
+
+  Buffer_t body = conn->body;
+  Buffer_t response = conn->response;
+  memset(conn, 0, sizeof(Connection_t));
+  conn->body = body;
+  conn->response = response;
+  conn->socket = socket;
+  conn->worker = worker;
+  conn->metrics = &server.metrics;
+  conn->state = CONN_READING;
+  conn->fileFd = -1;
+  atomic_fetch_add_explicit(&server.metrics.connections, 1,
+                            memory_order_relaxed);
+  return conn;
+}
+
+static void conn_recycle(Connection_t *conn) {
+  atomic_fetch_sub_explicit(&server.metrics.connections, 1,
+                            memory_order_relaxed);
+  conn->socket = -1;
+  buffer_recycle(&conn->body);
+  buffer_recycle(&conn->response);
+  conn->nextFree = conn->worker->freeConnections;
+  conn->worker->freeConnections = conn;
+}
+
+static void conn_close(Connection_t *conn) {
+  if (conn->state == CONN_CLOSED)
+    return;
+  Worker_t *worker = conn->worker;
+  for (Connection_t **waiting = &worker->waitingConnections; *waiting != NULL;
+       waiting = &(*waiting)->nextWaiting) {
+    if (*waiting == conn) {
+      *waiting = conn->nextWaiting;
+      break;
+    }
+  }
+  for (Connection_t **stream = &worker->streamConnections; *stream != NULL;
+       stream = &(*stream)->nextStream) {
+    if (*stream == conn) {
+      *stream = conn->nextStream;
+      break;
+    }
+  }
+  epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, conn->socket, NULL);
+  close(conn->socket);
+  conn->socket = -1;
+  release_body(conn);
+  conn->state = CONN_CLOSED;
+  conn->nextClosed = worker->closedConnections;
+  worker->closedConnections = conn;
+}
+
+static void conn_receive(Connection_t *conn);
+
+// Flush as much of the queued responses as the socket takes without blocking
+static void conn_write(Connection_t *conn) {
+  Buffer_t *response = &conn->response;
+  while (conn->state != CONN_CLOSING) {
+    size_t bodyLength = 0;
+    const char *body = memory_body(conn, &bodyLength);
+    size_t unsent = response->length - conn->responseSent;
+    ssize_t n;
+    if (body != NULL && conn->bodySent < bodyLength) {
+      // Headers and body leave in one call, the body is not copied
+      struct iovec iov[2];
+      int count = 0;
+      if (unsent > 0)
+        iov[count++] =
+            (struct iovec){response->data + conn->responseSent, unsent};
+      iov[count++] = (struct iovec){(char *)body + conn->bodySent,
+                                    bodyLength - conn->bodySent};
+      n = writev(conn->socket, iov, count);
+      if (n > 0) {
+        size_t headers = (size_t)n < unsent ? (size_t)n : unsent;
+        conn->responseSent += headers;
+        conn->bodySent += n - headers;
+        metric_add(&server.metrics.bytesSent, n);
+        continue;
+      }
+    } else if (unsent > 0) {
+      n = send(conn->socket, response->data + conn->responseSent, unsent,
+               MSG_NOSIGNAL);
+      if (n > 0) {
+        conn->responseSent += n;
+        metric_add(&server.metrics.bytesSent, n);
+        continue;
+      }
+    } else if (conn->file != NULL && body == NULL &&
+               conn->bodySent < conn->file->length) {
+      off_t offset = conn->bodySent;
+      n = sendfile(conn->socket, conn->fileFd, &offset,
+                   conn->file->length - conn->bodySent);
+      if (n > 0) {
+        conn->bodySent += n;
+        metric_add(&server.metrics.bytesSent, n);
+        continue;
+      }
+    } else if (conn->file != NULL || conn->snapshot != NULL) {
+      // Answer the pipelined requests held back by the body
+      response->length = 0;
+      conn->responseSent = 0;
+      release_body(conn);
+      conn_receive(conn);
+      continue;
+    } else {
+      break;
+    }
+    if (n == 0) {
+      conn->state = CONN_CLOSING; // file shrank since startup
+      return;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      conn->state = CONN_CLOSING;
+    return;
+  }
+  response->length = 0;
+  conn->responseSent = 0;
+  if (conn->closeAfterWrite && conn->state == CONN_READING)
+    conn->state = CONN_CLOSING;
+}
+
+// Answer the complete requests already buffered, then read what the socket
+// has and answer the complete requests among it
+static void conn_receive(Connection_t *conn) {
+  conn_process(conn);
+  while (conn->state == CONN_READING && !conn->closeAfterWrite &&
+         conn->requestLength < SIZE - 1) {
+    ssize_t n = read(conn->socket, conn->request + conn->requestLength,
+                     SIZE - 1 - conn->requestLength);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        conn->state = CONN_CLOSING;
+      return;
+    }
+    if (n == 0) {
+      conn->closeAfterWrite = true;
+      return;
+    }
+    conn->requestLength += n;
+    conn->request[conn->requestLength] = '\0';
+    conn_process(conn);
+  }
+}
+
+// Clients of the shared port, or of home's Unix-domain socket
+static void accept_connections(Worker_t *worker, int listenSocket,
+                               ThisUI *home) {
+  while (1) {
+    int clientSocket =
+        accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientSocket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    Connection_t *conn = conn_acquire(worker, clientSocket);
+    if (conn == NULL) {
+      static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n\r\n";
+      send(clientSocket, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+      close(clientSocket);
+      continue;
+    }
+    conn->home = home;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP |
+                                          EPOLLET,
+                                .data.ptr = conn};
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+      close(clientSocket);
+      conn_recycle(conn);
+    }
+  }
+}
+
+// Answer the worker's /program requests for the instance, parked until the
+// plugin applied the change, then carry on with whatever the clients
+// pipelined behind them
+static void answer_waiting_connections(Worker_t *worker, ThisUI *ui) {
+  Connection_t *waiting = NULL;
+  for (Connection_t **at = &worker->waitingConnections; *at != NULL;) {
+    Connection_t *conn = *at;
+    if (conn->ui == ui) {
+      *at = conn->nextWaiting;
+      conn->nextWaiting = waiting;
+      waiting = conn;
+    } else {
+      at = &conn->nextWaiting;
+    }
+  }
+  while (waiting != NULL) {
+    Connection_t *conn = waiting;
+    waiting = conn->nextWaiting;
+    conn->state = CONN_READING;
+    sendControls(ui, conn);
+    conn_process(conn);
+    conn_receive(conn);
+    conn_write(conn);
+    if (conn->state == CONN_CLOSING)
+      conn_close(conn);
+  }
+}
+
+// Forward what port_event and the other workers posted to the worker's
+// streaming clients
+static void handle_notifications(Worker_t *worker, ThisUI *ui) {
+  uint64_t count;
+  while (read(ui->notifyFds[worker->index], &count, sizeof(count)) > 0)
+    ;
+
+  unsigned int *tail = &ui->broadcastTails[worker->index];
+  while (1) {
+    char text[BROADCAST_LENGTH];
+    pthread_mutex_lock(&ui->notifyLock);
+    if (ui->broadcastHead - *tail > BROADCAST_SIZE)
+      *tail = ui->broadcastHead - BROADCAST_SIZE;
+    bool pending = *tail != ui->broadcastHead;
+    if (pending) {
+      Broadcast_t *broadcast = &ui->broadcast[*tail % BROADCAST_SIZE];
+      if (broadcast->worker == worker->index)
+        text[0] = '\0';
+      else
+        strcpy(text, broadcast->text);
+      (*tail)++;
+    }
+    bool stateChanged = ui->stateSeen[worker->index] != ui->stateChanges;
+    ui->stateSeen[worker->index] = ui->stateChanges;
+    pthread_mutex_unlock(&ui->notifyLock);
+
+    if (pending && text[0] != '\0')
+      broadcast_control(worker, ui, text, NULL);
+    if (stateChanged) {
+      answer_waiting_connections(worker, ui);
+      broadcast_state(worker, ui);
+    }
+    if (!pending)
+      break;
+  }
+}
+
+// Flush broadcasts and release the connections closed during this batch
+static void finish_events(Worker_t *worker) {
+  if (worker->streamsPending) {
+    worker->streamsPending = false;
+    Connection_t *next;
+    for (Connection_t *conn = worker->streamConnections; conn != NULL;
+         conn = next) {
+      next = conn->nextStream;
+      conn_write(conn);
+      if (conn->state == CONN_CLOSING)
+        conn_close(conn);
+    }
+  }
+
+  while (worker->closedConnections != NULL) {
+    Connection_t *conn = worker->closedConnections;
+    worker->closedConnections = conn->nextClosed;
+    conn_recycle(conn);
+  }
+}
+
+static void worker_wake(Worker_t *worker) {
+  uint64_t one = 1;
+  write(worker->wakeFd, &one, sizeof(one));
+}
+
+// Stop reading from the connection and close it once its queued responses
+// are out. A parked request is dropped and a stream is told that the server
+// is going away.
+static void conn_finish(Connection_t *conn) {
+  if (conn->state == CONN_WAITING) {
+    conn_close(conn);
+    return;
+  }
+  if (conn->stream == STREAM_WEBSOCKET && !conn->closeAfterWrite)
+    websocket_send(conn, 0x8, "\x03\xe9", 2); // 1001
+  conn->closeAfterWrite = true;
+  conn_write(conn);
+  if (conn->state == CONN_CLOSING)
+    conn_close(conn);
+}
+
+// Let go of a detaching instance, so that it can be freed, and tell whether
+// the server is to stop. The worker's connections to it, and those that came
+// in on its Unix-domain socket, finish what they were sending without it.
+static bool handle_wake(Worker_t *worker) {
+  uint64_t count;
+  while (read(worker->wakeFd, &count, sizeof(count)) > 0)
+    ;
+
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = worker->detaching;
+  bool stopping = server.stopping;
+  pthread_mutex_unlock(&server.lock);
+
+  if (ui != NULL) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+      Connection_t *conn = &worker->connections[i];
+      if (conn->socket < 0 || conn->state == CONN_CLOSED ||
+          (conn->ui != ui && conn->home != ui))
+        continue;
+      conn_finish(conn);
+      conn->ui = conn->home = NULL;
+      conn->metrics = &server.metrics;
+    }
+    finish_events(worker);
+
+    pthread_mutex_lock(&server.lock);
+    worker->detaching = NULL;
+    if (--server.detachPending == 0)
+      pthread_cond_broadcast(&server.detached);
+    pthread_mutex_unlock(&server.lock);
+  }
+  return stopping;
+}
+
+// Release the worker's share of the port at once, then give the responses
+// already queued up to DRAIN_TIMEOUT_MS to go out
+static void worker_drain(Worker_t *worker) {
+  epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, worker->serverSocket, NULL);
+  close(worker->serverSocket);
+  worker->serverSocket = -1;
+
+  int open = 0;
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    Connection_t *conn = &worker->connections[i];
+    if (conn->socket < 0 || conn->state == CONN_CLOSED)
+      continue;
+    conn_finish(conn);
+    if (conn->state != CONN_CLOSED)
+      open++;
+  }
+  finish_events(worker);
+
+  uint64_t deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000ull;
+  struct epoll_event events[MAX_EVENTS];
+  for (uint64_t now = now_ns(); open > 0 && now < deadline; now = now_ns()) {
+    int n = epoll_wait(worker->epollFd, events, MAX_EVENTS,
+                       (deadline - now) / 1000000 + 1);
+    for (int i = 0; i < n; i++) {
+      Connection_t *conn = events[i].data.ptr;
+      if (conn < worker->connections ||
+          conn >= worker->connections + MAX_CONNECTIONS ||
+          conn->state == CONN_CLOSED)
+        continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        conn->state = CONN_CLOSING;
+      conn_write(conn);
+      if (conn->state == CONN_CLOSING) {
+        conn_close(conn);
+        open--;
+      }
+    }
+    finish_events(worker);
+  }
+}
+
+static void *worker_run(void *arg) {
+  Worker_t *worker = arg;
+
+  // A client going away during sendfile must not take the host down
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  bool stopping = false;
+  while (!stopping) {
+    int n = epoll_wait(worker->epollFd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("Error: The server event loop failed.\n");
+      break;
+    }
+
+    // Instances detach between batches, as events already taken may still
+    // be for them
+    bool woken = false;
+    for (int i = 0; i < n; i++) {
+      void *source = events[i].data.ptr;
+      if (source == &worker->serverSocket) {
+        accept_connections(worker, worker->serverSocket, NULL);
+        continue;
+      }
+      if (source >= (void *)server.listeners &&
+          source < (void *)(server.listeners + MAX_LISTENERS)) {
+        Listener_t *listener = source;
+        accept_connections(worker, listener->socket, listener->ui);
+        continue;
+      }
+      if (source == &worker->wakeFd) {
+        woken = true;
+        continue;
+      }
+      if (source == &server.oscSocket) {
+        osc_receive();
+        continue;
+      }
+      Connection_t *conn = source;
+      if (conn < worker->connections ||
+          conn >= worker->connections + MAX_CONNECTIONS) {
+        handle_notifications(worker, source); // an instance's notifyFd
+        continue;
+      }
+
+      if (conn->state == CONN_CLOSED)
+        continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        conn->state = CONN_CLOSING;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+        conn_receive(conn);
+      conn_write(conn);
+      if (conn->state == CONN_CLOSING)
+        conn_close(conn);
+    }
+    finish_events(worker);
+    if (woken)
+      stopping = handle_wake(worker);
+  }
+  if (stopping)
+    worker_drain(worker);
+
+  // Detaching instances no longer wait for this worker
+  pthread_mutex_lock(&server.lock);
+  worker->serving = false;
+  if (worker->detaching != NULL) {
+    worker->detaching = NULL;
+    if (--server.detachPending == 0)
+      pthread_cond_broadcast(&server.detached);
+  }
+  pthread_mutex_unlock(&server.lock);
+  return NULL;
+}
+
+// Bind the worker's listening socket and set up its event loop. Several
+// workers share the port with SO_REUSEPORT, which is only set then: with it a
+// second process would quietly take a share of the clients instead of
+// failing to bind.
+static bool worker_open(Worker_t *worker, int port) {
+  if (!pool_init(worker)) {
+    printf("Error: No memory for the connection pool.\n");
+    return false;
+  }
+
+  struct sockaddr_in serverAddress;
+  serverAddress.sin_family = AF_INET; // IPv4
+  serverAddress.sin_port =
+      htons(port); // port number in network byte order
+                   // (host-to-network short)
+  serverAddress.sin_addr.s_addr =
+      htonl(INADDR_ANY); // localhost (host to network long)
+
+  worker->serverSocket =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  setsockopt(worker->serverSocket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+             sizeof(int));
+  if (server.nmbWorkers > 1)
+    setsockopt(worker->serverSocket, SOL_SOCKET, SO_REUSEPORT, &(int){1},
+               sizeof(int));
+
+  if (bind(worker->serverSocket, (struct sockaddr *)&serverAddress,
+           sizeof(serverAddress)) < 0) {
+    printf("Error: The server is not bound to the address.\n");
+    return false;
+  }
+
+  if (listen(worker->serverSocket, BACKLOG) < 0) {
+    printf("Error: The server is not listening.\n");
+    return false;
+  }
+
+  worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->epollFd < 0 || worker->wakeFd < 0) {
+    printf("Error: The server has no event loop.\n");
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                              .data.ptr = &worker->serverSocket};
+  epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->serverSocket, &event);
+  event.data.ptr = &worker->wakeFd;
+  epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event);
+  return true;
+}
+
+// Take OSC messages over UDP on OSC_PORT, when it is set. The first worker
+// serves them. The server runs without OSC if the port cannot be bound.
+static void osc_open(void) {
+  const char *port = getenv("OSC_PORT");
+  if (port == NULL || atoi(port) <= 0)
+    return;
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(atoi(port)),
+                                .sin_addr.s_addr = htonl(INADDR_ANY)};
+  server.oscSocket =
+      socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.oscSocket < 0 ||
+      bind(server.oscSocket, (struct sockaddr *)&address, sizeof(address)) <
+          0) {
+    printf("Error: The OSC socket is not bound to the address.\n");
+    if (server.oscSocket >= 0)
+      close(server.oscSocket);
+    server.oscSocket = -1;
+    return;
+  }
+  struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                              .data.ptr = &server.oscSocket};
+  epoll_ctl(server.workers[0].epollFd, EPOLL_CTL_ADD, server.oscSocket,
+            &event);
+}
+
+// Stop the workers that run and wait for them
+static void server_stop(void) {
+  pthread_mutex_lock(&server.lock);
+  server.stopping = true;
+  pthread_mutex_unlock(&server.lock);
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    if (!worker->started)
+      continue;
+    worker_wake(worker);
+    pthread_join(worker->thread, NULL);
+    worker->started = false;
+  }
+}
+
+static void server_free(void) {
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    if (worker->serverSocket >= 0)
+      close(worker->serverSocket);
+    if (worker->epollFd >= 0)
+      close(worker->epollFd);
+    if (worker->wakeFd >= 0)
+      close(worker->wakeFd);
+    worker->serverSocket = worker->epollFd = worker->wakeFd = -1;
+    pool_free(worker);
+  }
+  if (server.oscSocket >= 0)
+    close(server.oscSocket);
+  server.oscSocket = -1;
+  server.nmbWorkers = 0;
+  free_static_files();
+}
+
+// Load the static files, bind the port and start the workers,
+// UI_BRIDGE_WORKERS of them, one by default
+static bool server_start(const char *staticPath, int port) {
+  load_static_files(staticPath, "");
+  prepare_static_files();
+
+  const char *workers = getenv("UI_BRIDGE_WORKERS");
+  server.nmbWorkers = workers != NULL ? atoi(workers) : 1;
+  if (server.nmbWorkers < 1)
+    server.nmbWorkers = 1;
+  if (server.nmbWorkers > MAX_WORKERS)
+    server.nmbWorkers = MAX_WORKERS;
+  for (int i = 0; i < server.nmbWorkers; i++)
+    server.workers[i] = (Worker_t){
+        .index = i, .serverSocket = -1, .epollFd = -1, .wakeFd = -1};
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    if (!worker_open(&server.workers[i], port))
+      return false;
+  }
+  osc_open();
+
+  server.stopping = false;
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    worker->serving = true;
+    int k = pthread_create(&worker->thread, NULL, worker_run, worker);
+    if (k != 0) {
+      fprintf(stderr, "%d : %s\n", k, "pthread_create : HTTPServer thread");
+      fflush(stderr);
+      worker->serving = false;
+      return false;
+    }
+    worker->started = true;
+  }
+  return true;
+}
+
+// UI_BRIDGE_NAME, numbered when instances in this process share it.
+// Caller holds server.lock.
+static const char *instance_name(ThisUI *ui) {
+  const char *name = getenv("UI_BRIDGE_NAME");
+  if (name == NULL || *name == '\0' || strpbrk(name, "/?") != NULL)
+    name = "bsynth";
+  snprintf(ui->name, sizeof(ui->name), "%s", name);
+  bool numbered = false;
+  for (int n = 2; find_instance(ui->name, strlen(ui->name)) != NULL; n++) {
+    snprintf(ui->name, sizeof(ui->name), "%.50s-%d", name, n);
+    numbered = true;
+  }
+  return numbered ? strrchr(ui->name, '-') : "";
+}
+
+// A listening Unix-domain socket at the address, -1 when it cannot be bound.
+// A socket left there by a process that is gone is replaced, one that still
+// takes connections is not.
+static int local_socket(const struct sockaddr_un *address) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  const struct sockaddr *at = (const struct sockaddr *)address;
+  bool bound = bind(fd, at, sizeof(*address)) == 0;
+  if (!bound && errno == EADDRINUSE) {
+    struct stat status;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && lstat(address->sun_path, &status) == 0 &&
+        S_ISSOCK(status.st_mode) && connect(probe, at, sizeof(*address)) < 0 &&
+        errno == ECONNREFUSED) {
+      unlink(address->sun_path);
+      bound = bind(fd, at, sizeof(*address)) == 0;
+    }
+    if (probe >= 0)
+      close(probe);
+  }
+  if (!bound || listen(fd, BACKLOG) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Listen for the instance on UI_BRIDGE_SOCKET too, when it is set. A path
+// ending in '/' is a directory that gets <name>.sock, any other path is
+// numbered as the name is when instances in this process share it.
+static void listener_open(ThisUI *ui, const char *suffix) {
+  const char *path = getenv("UI_BRIDGE_SOCKET");
+  if (path == NULL || *path == '\0' || !server.started)
+    return;
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  size_t length =
+      path[strlen(path) - 1] == '/'
+          ? snprintf(address.sun_path, sizeof(address.sun_path), "%s%s.sock",
+                     path, ui->name)
+          : snprintf(address.sun_path, sizeof(address.sun_path), "%s%s", path,
+                     suffix);
+  int listenSocket =
+      length < sizeof(address.sun_path) ? local_socket(&address) : -1;
+  if (listenSocket < 0) {
+    printf("Error: The local socket is not bound to %s.\n", address.sun_path);
+    return;
+  }
+
+  Listener_t *listener = NULL;
+  pthread_mutex_lock(&server.lock);
+  for (int i = 0; i < MAX_LISTENERS && listener == NULL; i++) {
+    if (server.listeners[i].ui == NULL) {
+      listener = &server.listeners[i];
+      *listener = (Listener_t){.ui = ui, .socket = listenSocket};
+      memcpy(listener->path, address.sun_path, sizeof(listener->path));
+    }
+  }
+  pthread_mutex_unlock(&server.lock);
+  if (listener == NULL) {
+    printf("Error: No room for another local socket.\n");
+    close(listenSocket);
+    unlink(address.sun_path);
+    return;
+  }
+  ui->listener = listener;
+
+  // One worker is woken for each client
+  struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                              .data.ptr = listener};
+  for (int i = 0; i < server.nmbWorkers; i++)
+    epoll_ctl(server.workers[i].epollFd, EPOLL_CTL_ADD, listenSocket, &event);
+}
+
+// Register the instance with the server, starting it for the first one.
+// Later instances share its port, whatever they ask for. Each worker
+// watches a notifyFd of its own for the instance.
+static void server_attach(ThisUI *ui, int port) {
+  pthread_mutex_lock(&server.lifecycle);
+  if (server.refs++ == 0) {
+    server.started = server_start(ui->static_path, port);
+    if (!server.started) {
+      server_stop();
+      server_free();
+    }
+  }
+
+  pthread_mutex_lock(&server.lock);
+  const char *suffix = instance_name(ui);
+  ThisUI **last = &server.instances;
+  while (*last != NULL)
+    last = &(*last)->nextInstance;
+  *last = ui;
+  pthread_mutex_unlock(&server.lock);
+
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    ui->notifyFds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = ui};
+    epoll_ctl(server.workers[i].epollFd, EPOLL_CTL_ADD, ui->notifyFds[i],
+              &event);
+  }
+  listener_open(ui, suffix);
+  pthread_mutex_unlock(&server.lifecycle);
+}
+
+// Unregister the instance once every worker has let go of it, and stop the
+// server with the last one
+static void server_detach(ThisUI *ui) {
+  pthread_mutex_lock(&server.lifecycle);
+  pthread_mutex_lock(&server.lock);
+  for (ThisUI **at = &server.instances; *at != NULL;
+       at = &(*at)->nextInstance) {
+    if (*at == ui) {
+      *at = ui->nextInstance;
+      break;
+    }
+  }
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, ui->notifyFds[i], NULL);
+    if (ui->listener != NULL)
+      epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, ui->listener->socket, NULL);
+    if (worker->serving) {
+      worker->detaching = ui;
+      server.detachPending++;
+      worker_wake(worker);
+    }
+  }
+  while (server.detachPending > 0)
+    pthread_cond_wait(&server.detached, &server.lock);
+  for (int i = 0; i < server.nmbWorkers; i++)
+    close(ui->notifyFds[i]);
+  if (ui->listener != NULL) {
+    close(ui->listener->socket);
+    unlink(ui->listener->path);
+    ui->listener->ui = NULL;
+    ui->listener = NULL;
+  }
+  bool last = --server.refs == 0;
+  pthread_mutex_unlock(&server.lock);
+
+  if (last && server.started) {
+    server_stop();
+    server.started = false;
+    server_free();
+  }
+  pthread_mutex_unlock(&server.lifecycle);
 }
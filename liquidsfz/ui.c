@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // accept4, SOCK_NONBLOCK
+
 #include <lilv/lilv.h>
 #include <lv2/atom/atom.h>
 #include <lv2/atom/forge.h>
@@ -14,24 +16,76 @@
 #include <lv2/urid/urid.h>
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <pthread.h>
 
-#include <netinet/in.h> // sockaddr_in
-#include <sys/socket.h> // socket APIs
-#include <unistd.h>     // open, close
-
-#include <signal.h> // signal handling
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netinet/in.h>   // sockaddr_in
+#include <sys/epoll.h>    // epoll APIs
+#include <sys/eventfd.h>  // eventfd
+#include <sys/mman.h>     // mmap, shm_open
+#include <sys/sendfile.h> // sendfile
+#include <sys/socket.h>   // socket APIs
+#include <sys/stat.h>     // stat
+#include <sys/un.h>       // sockaddr_un
+#include <unistd.h>       // open, close
+
+#include <signal.h> // pthread_sigmask
 
 #define SIZE 1024 // buffer size
 
-#define BACKLOG 10 // number of pending connections queue will hold
+#define BACKLOG 128 // number of pending connections queue will hold
+
+#define DEFAULT_HTTP_PORT 25550 // served without a valid HTTP_PORT
+
+#define MAX_EVENTS 64 // epoll events handled per wakeup
+
+#define MAX_METHOD 16  // longest request method accepted
+#define MAX_HEADERS 32 // header fields accepted per request
+
+#define MAX_CONNECTIONS 64 // clients served at once by a worker, more are
+                           // turned away
+
+#define MAX_WORKERS 32 // event loop threads, UI_BRIDGE_WORKERS picks how many
+#define OSC_PACKET_SIZE 8192 // longest OSC datagram accepted
+#define OSC_MAX_CHANGES 256  // control changes applied together from a packet
+#define OSC_MAX_DEPTH 8      // nesting of OSC bundles
+#define MAX_LISTENERS 64 // instances with a Unix-domain socket of their own
+
+#define DRAIN_TIMEOUT_MS 250 // longest wait for responses in flight when the
+                             // server stops
+
+#define HISTOGRAM_SUB_BITS 2  // each power of two is split in 1 << bits
+#define HISTOGRAM_BUCKETS 128 // in nanoseconds, up to about 4 s
+#define ARENA_SIZE 8192    // per connection, backs its body and response
+
+#define MAX_CACHED_FILE (1 << 20) // larger static files are sent with sendfile
+
+#define CHANGE_RING_SIZE 256 // control changes queued for ui_idle, power of 2
+
+#define SCHEMA_MAGIC "LV2UIWS1" // first bytes of a schema cache file
+#define SCHEMA_SYMBOL 64        // longest control symbol kept
+#define SCHEMA_URI 192          // longest parameter URI kept
+#define SCHEMA_PORTS 4096       // port indices a control may have
+
+#define CHANNEL_MAGIC "LV2UISM1" // first bytes of a control channel segment
+#define CHANNEL_RING_SIZE 1024   // change records in the segment, power of 2
+#define CHANNEL_NAME 64          // longest control name in the segment
 
 #define UI_URI "http://helander.network/lv2uiweb/liquidsfz"
 
@@ -86,7 +140,221 @@ typedef struct {
 } PluginControl_t;
 */
 
+typedef enum {
+  CONTROL_PORT, // lv2:ControlPort input, written as a float
+  CONTROL_FLOAT, // patch:writable parameters by rdfs:range, sent as patch:Set
+  CONTROL_DOUBLE,
+  CONTROL_INT,
+  CONTROL_LONG,
+  CONTROL_BOOL,
+  CONTROL_PATH, // listed, not set through /control
+  CONTROL_STRING
+} ControlType_t;
+
+// A control as stored in the schema cache file. Fixed size, so the table is
+// used straight from the mapping.
+typedef struct {
+  char symbol[SCHEMA_SYMBOL]; // port symbol or parameter URI fragment
+  char uri[SCHEMA_URI];       // parameter URI, empty for ports
+  uint32_t type;              // ControlType_t
+  uint32_t port;              // port index of CONTROL_PORT
+  float minimum;              // equal bounds mean unbounded
+  float maximum;
+  float defaultValue;
+} ControlSchema_t;
+
+// Schema cache files are this header followed by the controls. They are valid
+// while the plugin's bundle has not changed.
+typedef struct {
+  char magic[8];
+  uint32_t schemaSize; // sizeof(ControlSchema_t) when it was written
+  uint32_t count;
+  int64_t bundleMtime; // newest mtime in the bundle directory
+  char pluginUri[256];
+  char bundlePath[PATH_MAX];
+} SchemaHeader_t;
+
+typedef struct {
+  const ControlSchema_t *schema;
+  LV2_URID property; // mapped parameter URI, 0 for ports
+  uint32_t symbolLength;
+  uint32_t hash; // key_hash of the symbol
+  _Atomic float value;
+  _Atomic float pending; // latest change that missed the ring, NAN when none
+} Control_t;
+
+typedef struct {
+  uint32_t control;
+  float value;
+  uint64_t queued; // when the server thread queued it, for the metrics
+} ControlChange_t;
+
+// Producers (the workers) hold the instance's queueLock, the consumer
+// (ui_idle) needs no lock
+typedef struct {
+  ControlChange_t changes[CHANGE_RING_SIZE];
+  _Atomic unsigned int head;
+  _Atomic unsigned int tail;
+} ChangeRing_t;
+
+// Shared memory control channel of an instance, UI_BRIDGE_SHM. One external
+// process writes records at head and publishes them by advancing it, waiting
+// while the ring is full, and ui_idle consumes them. Each record is stored
+// and read as one 64 bit word. A writer that does not wait overruns the ring:
+// the oldest records are then dropped and counted as overrun. The controls
+// follow, in the order records refer to them, with the value last sent to or
+// reported by the plugin for readers to poll.
+typedef struct {
+  uint32_t control; // index into controls
+  float value;
+} ChannelRecord_t;
+
+_Static_assert(sizeof(ChannelRecord_t) == sizeof(uint64_t),
+               "a channel record is read with one 64 bit load");
+
+typedef struct {
+  char name[CHANNEL_NAME];
+  _Atomic float value;
+} ChannelControl_t;
+
+typedef struct {
+  char magic[8]; // CHANNEL_MAGIC, written once the rest is set up
+  uint32_t pid;  // of the host process
+  uint32_t ringSize;
+  uint32_t nmbControls;
+  _Alignas(64) _Atomic uint32_t head; // advanced by the writer
+  _Alignas(64) _Atomic uint32_t tail; // advanced by ui_idle
+  _Alignas(64) _Atomic uint64_t ring[CHANNEL_RING_SIZE]; // ChannelRecord_t
+  ChannelControl_t controls[];
+} Channel_t;
+
+typedef enum {
+  SFZ_IDLE,    // no file loaded that the UI knows of
+  SFZ_LOADING, // asked for and not answered by the plugin yet
+  SFZ_READY,
+  SFZ_FAILED // the plugin answered with another file than the one asked for
+} SfzState_t;
+
+// The plugin loads an SFZ file on its worker thread and then answers with a
+// patch:Set of liquidsfz:sfzfile naming the file it has. Kept by the UI
+// thread and the workers under the instance's sfzLock.
+typedef struct {
+  SfzState_t state;
+  char path[PATH_MAX];   // asked for, or the file the plugin reported
+  char loaded[PATH_MAX]; // last reported by the plugin
+  uint64_t started;      // when the load was asked for
+  uint64_t finished;
+  unsigned int outstanding; // sent to the plugin and not answered yet
+  unsigned int generation;  // loads asked for so far
+} SfzLoad_t;
+
+// Requests are counted under the first label whose prefix matches the route
+static const char *routeLabels[][2] = {
+    {"/controls", "controls"}, {"/control/", "control"},
+    {"/schema", "schema"},     {"/level/", "level"},
+    {"/metrics", "metrics"},   {"/sfz", "sfz"},
+    {"/", "static"}};
+
+#define ROUTE_LABELS (sizeof(routeLabels) / sizeof(routeLabels[0]))
+
+// Log-linear, in the manner of HDR histograms: a bucket for each of the
+// 1 << HISTOGRAM_SUB_BITS steps within every power of two
+typedef struct {
+  _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t sum;
+} Histogram_t;
+
+// Updated with relaxed atomics from the server thread and the host's UI
+// thread, read by /metrics
+typedef struct {
+  _Atomic uint64_t requests[ROUTE_LABELS];
+  _Atomic uint64_t notFound;
+  _Atomic uint64_t bytesSent;
+  _Atomic int64_t connections;
+  _Atomic uint64_t oscApplied;  // OSC messages that set a control
+  _Atomic uint64_t oscRejected; // malformed or unknown, the server's only
+  _Atomic uint64_t channelApplied;  // control channel records staged
+  _Atomic uint64_t channelRejected; // for a control the UI does not set
+  _Atomic uint64_t channelOverrun;  // dropped, the writer overran them
+  _Atomic uint64_t sfzReady;  // SFZ loads the plugin completed
+  _Atomic uint64_t sfzFailed; // and those it answered with another file
+  Histogram_t parseTime;
+  Histogram_t queueTime;
+} Metrics_t;
+
+// A file under static_path, loaded when the server starts
+typedef struct StaticFile {
+  char route[100];
+  char path[PATH_MAX];
+  const char *mimeType;
+  time_t mtime;
+  char etag[40];
+  char headers[384]; // status line and entity headers, without the blank line
+  size_t headerLength;
+  char notModified[256]; // the same for a 304 reply
+  size_t notModifiedLength;
+  char *body; // NULL when the file is too large to keep in memory
+  size_t length;
+  const char *encoding;      // set on .gz/.br sidecars of another file
+  struct StaticFile *gzip;   // precompressed sidecars, if present
+  struct StaticFile *brotli;
+  struct StaticFile *next;
+} StaticFile_t;
+
 typedef struct {
+  char *data;
+  size_t length;
+  size_t size;
+  char *arena; // fixed storage the buffer starts out in, data only moves to
+  size_t arenaSize; // the heap when a burst outgrows it
+} Buffer_t;
+
+typedef enum {
+  CONN_READING, // collecting and answering requests
+  CONN_CLOSING
+} ConnectionState_t;
+
+// Views into the connection buffer: the parser NUL terminates the method,
+// the route and the header values in place
+typedef struct {
+  char *method;
+  char *route;
+  bool keepAlive;
+  size_t bodyOffset;
+  size_t bodyLength;
+  const char *ifNoneMatch; // NULL when absent
+  time_t ifModifiedSince;  // -1 when absent
+  bool acceptGzip;
+  bool acceptBrotli;
+  size_t length;      // header block plus body
+  const char *error; // status of the reply when the request is rejected
+} HttpRequest_t;
+
+typedef struct Connection {
+  int socket;
+  struct Worker *worker; // whose pool and event loop it belongs to
+  struct ThisUI *ui;  // instance of the latest request
+  Metrics_t *metrics; // of that instance, the server's until then
+  struct ThisUI *home; // whose Unix-domain socket it came in on, NULL over TCP
+  ConnectionState_t state;
+  bool keepAlive;       // current request allows the connection to persist
+  bool closeAfterWrite; // no more requests are read from this connection
+  char request[SIZE];
+  size_t requestLength;
+  HttpRequest_t current; // request at the start of the buffer
+  bool headersParsed;    // its header block is complete and parsed
+  size_t scanned;        // bytes already searched for the end of the headers
+  Buffer_t body;     // body of the response being built
+  Buffer_t response; // responses queued for sending, in request order
+  size_t responseSent;
+  const StaticFile_t *file; // body sent after the queued response, later
+                            // pipelined requests wait for it
+  int fileFd;               // open file when it goes out with sendfile
+  size_t fileSent;
+  struct Connection *nextFree;
+} Connection_t;
+
+typedef struct ThisUI {
   LV2_Atom_Forge forge;
   LV2_URID_Map *map;
   LV2_URID_Unmap *unmap;
@@ -111,6 +379,9 @@ typedef struct {
   LV2_URID atom_String;
   LV2_URID atom_Int;
   LV2_URID atom_Float;
+  LV2_URID atom_Double;
+  LV2_URID atom_Long;
+  LV2_URID atom_Bool;
   LV2_URID atom_URID;
   LV2_URID atom_Path;
   LV2_URID midi_MidiEvent;
@@ -133,14 +404,98 @@ typedef struct {
 //  uint8_t currentProgram;
 //  bool programChange;
 
-  int http_port;
-  pthread_t t_http_server;
-  int serverSocket;
-  int clientSocket;
-  char *request;
+  const ControlSchema_t *schemas; // discovered from the plugin's metadata
+  void *schemaMap;                 // mapped schema cache file, if any
+  size_t schemaMapLength;
+  ControlSchema_t *discovered; // schemas read through lilv, when not mapped
+  Control_t *controls;
+  uint32_t nmbControls;
+  uint32_t *controlSlots; // open addressing by symbol, control index + 1
+  uint32_t *propertySlots; // the same by parameter URID
+  uint32_t controlSlotsMask;
+  uint32_t *portControls; // control index + 1 by port index
+  uint32_t nmbPorts;
+  float *tickValues; // staged by ui_idle, NAN when unchanged this tick
+  uint32_t *tickChanged;
+  uint32_t tickChangedCount;
+  Channel_t *channel; // NULL without UI_BRIDGE_SHM, only the UI thread uses it
+  size_t channelSize;
+  char channelName[NAME_MAX];
+
+  pthread_mutex_t sfzLock; // the UI thread and the workers, for sfzLoad
+  SfzLoad_t sfzLoad;
+  _Atomic bool sfzQueued; // a load waits for ui_idle to send it
+
+  pthread_mutex_t queueLock; // workers queueing changes for ui_idle
+  ChangeRing_t changeRing;
+  _Atomic bool changesCoalesced; // set while changes bypass the full ring
+
+  char name[64]; // routes under /i/<name>/ reach this instance
+  struct Listener *listener; // its Unix-domain socket, NULL without one
+  struct ThisUI *nextInstance;
+  Metrics_t metrics;
 
 } ThisUI;
 
+// An event loop thread with its own listening socket on the shared port.
+// The kernel spreads new connections over the workers and a connection stays
+// with the one that accepted it.
+typedef struct Worker {
+  pthread_t thread;
+  bool started;      // the thread runs or waits to be joined
+  bool serving;      // the thread has not left its event loop
+  ThisUI *detaching; // until the worker has let go of its connections
+  int serverSocket;
+  int epollFd;
+  int wakeFd; // signalled when an instance detaches or the server stops
+  Connection_t *connections; // pool allocated when the server starts
+  char *arenas;
+  Connection_t *freeConnections;
+} Worker_t;
+
+// An instance's Unix-domain socket, UI_BRIDGE_SOCKET. Every worker watches
+// it and the one woken for a client accepts it.
+typedef struct Listener {
+  ThisUI *ui; // NULL for a free slot
+  int socket;
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} Listener_t;
+
+// One server per process, shared by all instances of the UI. The first
+// instantiate starts it and the last cleanup stops it.
+typedef struct {
+  pthread_mutex_t lifecycle; // held while instances attach and detach
+  pthread_mutex_t lock; // instances, stopping, detachPending and the workers'
+                        // serving and detaching
+  pthread_cond_t detached;
+  int refs;
+  ThisUI *instances; // in instantiation order, the first one also answers
+                     // the routes without an /i/<name> prefix
+  int detachPending; // workers yet to let go of a detaching instance
+  bool started;      // all workers run
+  bool stopping;
+  StaticFile_t *staticFiles;
+  Metrics_t metrics; // connections, bytes sent and parse time of all
+                     // instances, the rest is counted per instance
+  Worker_t workers[MAX_WORKERS];
+  int nmbWorkers; // fixed while the server runs
+  int oscSocket;  // UDP, served by the first worker, -1 without OSC_PORT
+  Listener_t listeners[MAX_LISTENERS]; // slots are taken under lock
+} Server_t;
+
+// Control changes decoded from an OSC packet. They are queued per instance
+// in one go, so ui_idle sends them in the same tick.
+typedef struct {
+  ThisUI *ui[OSC_MAX_CHANGES];
+  ControlChange_t changes[OSC_MAX_CHANGES];
+  unsigned int count;
+} OscBatch_t;
+
+static Server_t server = {.lifecycle = PTHREAD_MUTEX_INITIALIZER,
+                          .lock = PTHREAD_MUTEX_INITIALIZER,
+                          .detached = PTHREAD_COND_INITIALIZER,
+                          .oscSocket = -1};
+
 /*
 static PluginControl_t *getPluginControl(ThisUI *ui, char *key) {
   for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
@@ -152,7 +507,660 @@ static PluginControl_t *getPluginControl(ThisUI *ui, char *key) {
 }
 */
 
-static void *http_server_run(void *inst);
+static bool ring_push(ChangeRing_t *ring, ControlChange_t change) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == CHANGE_RING_SIZE)
+    return false;
+  ring->changes[head % CHANGE_RING_SIZE] = change;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+// All of the changes or, when they do not fit, none
+static bool ring_push_many(ChangeRing_t *ring, const ControlChange_t *changes,
+                           unsigned int count) {
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (CHANGE_RING_SIZE - (head - tail) < count)
+    return false;
+  for (unsigned int i = 0; i < count; i++)
+    ring->changes[(head + i) % CHANGE_RING_SIZE] = changes[i];
+  atomic_store_explicit(&ring->head, head + count, memory_order_release);
+  return true;
+}
+
+static bool ring_pop(ChangeRing_t *ring, ControlChange_t *change) {
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail)
+    return false;
+  *change = ring->changes[tail % CHANGE_RING_SIZE];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void metric_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static unsigned int histogram_bucket(uint64_t ns) {
+  if (ns < (1 << HISTOGRAM_SUB_BITS))
+    return ns;
+  unsigned int exponent = 63 - __builtin_clzll(ns);
+  unsigned int step = (ns >> (exponent - HISTOGRAM_SUB_BITS)) &
+                      ((1 << HISTOGRAM_SUB_BITS) - 1);
+  unsigned int bucket =
+      ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + step;
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value counted in bucket
+static uint64_t histogram_bound(unsigned int bucket) {
+  if (bucket < (1 << HISTOGRAM_SUB_BITS))
+    return bucket;
+  unsigned int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t step = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return (((1 << HISTOGRAM_SUB_BITS) + step + 1) << shift) - 1;
+}
+
+static void histogram_record(Histogram_t *histogram, uint64_t ns) {
+  metric_add(&histogram->counts[histogram_bucket(ns)], 1);
+  metric_add(&histogram->sum, ns);
+}
+
+// Hand a control change to ui_idle without ever blocking a worker. Once the
+// ring is full, changes are coalesced to the latest value per control until
+// ui_idle has caught up, so the plugin still sees them in order.
+static void queue_change(ThisUI *ui, uint32_t control, float value) {
+  pthread_mutex_lock(&ui->queueLock);
+  if (atomic_load_explicit(&ui->changesCoalesced, memory_order_relaxed) ||
+      !ring_push(&ui->changeRing,
+                 (ControlChange_t){control, value, now_ns()})) {
+    atomic_store_explicit(&ui->controls[control].pending, value,
+                          memory_order_relaxed);
+    atomic_store_explicit(&ui->changesCoalesced, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&ui->queueLock);
+}
+
+// Several changes that ui_idle must see together, as queue_change otherwise
+static void queue_changes(ThisUI *ui, ControlChange_t *changes,
+                          unsigned int count) {
+  uint64_t queued = now_ns();
+  for (unsigned int i = 0; i < count; i++)
+    changes[i].queued = queued;
+  pthread_mutex_lock(&ui->queueLock);
+  if (atomic_load_explicit(&ui->changesCoalesced, memory_order_relaxed) ||
+      !ring_push_many(&ui->changeRing, changes, count)) {
+    for (unsigned int i = 0; i < count; i++)
+      atomic_store_explicit(&ui->controls[changes[i].control].pending,
+                            changes[i].value, memory_order_relaxed);
+    atomic_store_explicit(&ui->changesCoalesced, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&ui->queueLock);
+}
+
+static uint32_t key_hash(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  return hash;
+}
+
+// The level port the UI has always written, used when lilv does not know the
+// plugin
+static const ControlSchema_t fallbackControls[] = {
+    {"level", "", CONTROL_PORT, 3, 0, 0, 0}};
+
+// Newest modification time of a bundle directory and the files in it, -1
+// when it cannot be read
+static int64_t bundle_mtime(const char *path) {
+  struct stat st;
+  DIR *dir = opendir(path);
+  if (dir == NULL || fstat(dirfd(dir), &st) != 0) {
+    if (dir != NULL)
+      closedir(dir);
+    return -1;
+  }
+  int64_t newest = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0)
+      continue;
+    int64_t mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    if (mtime > newest)
+      newest = mtime;
+  }
+  closedir(dir);
+  return newest;
+}
+
+// $XDG_CACHE_HOME/lv2uiweb/<hash of the plugin URI>.schema
+static bool schema_cache_path(const char *pluginUri, char *path, size_t size) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  uint32_t hash = key_hash(pluginUri, strlen(pluginUri));
+  int length;
+  if (cache != NULL && cache[0] == '/')
+    length = snprintf(path, size, "%s/lv2uiweb/%08x.schema", cache, hash);
+  else if (home != NULL && home[0] == '/')
+    length = snprintf(path, size, "%s/.cache/lv2uiweb/%08x.schema", home, hash);
+  else
+    return false;
+  return length > 0 && (size_t)length < size;
+}
+
+// Map the cache file if it holds the schema of this plugin as its bundle is
+// now
+static bool schema_map(ThisUI *ui, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SchemaHeader_t))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const SchemaHeader_t *header = map;
+  const ControlSchema_t *schemas = (const ControlSchema_t *)(header + 1);
+  bool valid =
+      !memcmp(header->magic, SCHEMA_MAGIC, sizeof(header->magic)) &&
+      header->schemaSize == sizeof(ControlSchema_t) &&
+      (uint64_t)st.st_size == sizeof(SchemaHeader_t) +
+                                  (uint64_t)header->count *
+                                      sizeof(ControlSchema_t) &&
+      memchr(header->pluginUri, '\0', sizeof(header->pluginUri)) != NULL &&
+      memchr(header->bundlePath, '\0', sizeof(header->bundlePath)) != NULL &&
+      !strcmp(header->pluginUri, ui->plugin_uri) &&
+      header->bundleMtime == bundle_mtime(header->bundlePath);
+  // The strings and port indices are used as they are, so a damaged file
+  // is rebuilt rather than trusted
+  for (uint32_t i = 0; valid && i < header->count; i++) {
+    const ControlSchema_t *schema = &schemas[i];
+    valid = memchr(schema->symbol, '\0', sizeof(schema->symbol)) != NULL &&
+            memchr(schema->uri, '\0', sizeof(schema->uri)) != NULL &&
+            schema->type <= CONTROL_STRING &&
+            (schema->type != CONTROL_PORT || schema->port < SCHEMA_PORTS);
+  }
+  if (!valid) {
+    munmap(map, st.st_size);
+    return false;
+  }
+  ui->schemaMap = map;
+  ui->schemaMapLength = st.st_size;
+  ui->schemas = schemas;
+  ui->nmbControls = header->count;
+  return true;
+}
+
+static ControlType_t control_type(const char *range) {
+  static const char *types[][2] = {
+      {LV2_ATOM__Float, "float"}, {LV2_ATOM__Double, "double"},
+      {LV2_ATOM__Int, "int"},     {LV2_ATOM__Long, "long"},
+      {LV2_ATOM__Bool, "bool"},   {LV2_ATOM__Path, "path"},
+      {LV2_ATOM__String, "string"}};
+  for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    if (!strcmp(range, types[i][0]))
+      return CONTROL_FLOAT + i;
+  return CONTROL_PORT; // not a parameter type the UI handles
+}
+
+static float node_float(LilvWorld *world, const LilvNode *subject,
+                        const LilvNode *predicate) {
+  LilvNode *node = lilv_world_get(world, subject, predicate, NULL);
+  float value = 0;
+  if (node != NULL && (lilv_node_is_float(node) || lilv_node_is_int(node)))
+    value = lilv_node_as_float(node);
+  lilv_node_free(node);
+  return value;
+}
+
+// The control input ports and the patch:writable parameters of the plugin
+static ControlSchema_t *schema_collect(LilvWorld *world,
+                                       const LilvPlugin *plugin,
+                                       SchemaHeader_t *header) {
+  LilvNode *controlPort = lilv_new_uri(world, LV2_CORE__ControlPort);
+  LilvNode *inputPort = lilv_new_uri(world, LV2_CORE__InputPort);
+  LilvNode *writable = lilv_new_uri(world, LV2_PATCH__writable);
+  LilvNode *range =
+      lilv_new_uri(world, "http://www.w3.org/2000/01/rdf-schema#range");
+  LilvNode *minimum = lilv_new_uri(world, LV2_CORE__minimum);
+  LilvNode *maximum = lilv_new_uri(world, LV2_CORE__maximum);
+  LilvNode *defaultValue = lilv_new_uri(world, LV2_CORE__default);
+
+  uint32_t nmbPorts = lilv_plugin_get_num_ports(plugin);
+  LilvNodes *parameters = lilv_plugin_get_value(plugin, writable);
+  uint32_t capacity = nmbPorts + lilv_nodes_size(parameters);
+  ControlSchema_t *schemas = calloc(capacity + 1, sizeof(ControlSchema_t));
+  float *ranges = malloc(3 * (nmbPorts + 1) * sizeof(float));
+  uint32_t count = 0;
+  if (schemas == NULL || ranges == NULL) {
+    free(schemas);
+    schemas = NULL;
+    goto done;
+  }
+
+  lilv_plugin_get_port_ranges_float(plugin, ranges, ranges + nmbPorts,
+                                    ranges + 2 * nmbPorts);
+  for (uint32_t i = 0; i < nmbPorts; i++) {
+    const LilvPort *port = lilv_plugin_get_port_by_index(plugin, i);
+    if (!lilv_port_is_a(plugin, port, controlPort) ||
+        !lilv_port_is_a(plugin, port, inputPort))
+      continue;
+    ControlSchema_t *schema = &schemas[count++];
+    snprintf(schema->symbol, sizeof(schema->symbol), "%s",
+             lilv_node_as_string(lilv_port_get_symbol(plugin, port)));
+    schema->type = CONTROL_PORT;
+    schema->port = i;
+    schema->minimum = isnan(ranges[i]) ? 0 : ranges[i];
+    schema->maximum = isnan(ranges[nmbPorts + i]) ? 0 : ranges[nmbPorts + i];
+    schema->defaultValue =
+        isnan(ranges[2 * nmbPorts + i]) ? 0 : ranges[2 * nmbPorts + i];
+  }
+
+  LILV_FOREACH(nodes, i, parameters) {
+    const LilvNode *parameter = lilv_nodes_get(parameters, i);
+    const char *uri = lilv_node_as_uri(parameter);
+    LilvNode *type = lilv_world_get(world, parameter, range, NULL);
+    ControlType_t controlType =
+        type != NULL ? control_type(lilv_node_as_uri(type)) : CONTROL_PORT;
+    lilv_node_free(type);
+    if (controlType == CONTROL_PORT || strlen(uri) >= SCHEMA_URI)
+      continue;
+    ControlSchema_t *schema = &schemas[count++];
+    const char *fragment = strrchr(uri, '#');
+    if (fragment == NULL)
+      fragment = strrchr(uri, '/');
+    snprintf(schema->symbol, sizeof(schema->symbol), "%.*s",
+             SCHEMA_SYMBOL - 1, fragment != NULL ? fragment + 1 : uri);
+    snprintf(schema->uri, sizeof(schema->uri), "%s", uri);
+    schema->type = controlType;
+    schema->minimum = node_float(world, parameter, minimum);
+    schema->maximum = node_float(world, parameter, maximum);
+    schema->defaultValue = node_float(world, parameter, defaultValue);
+  }
+
+  memset(header, 0, sizeof(SchemaHeader_t));
+  memcpy(header->magic, SCHEMA_MAGIC, sizeof(header->magic));
+  header->schemaSize = sizeof(ControlSchema_t);
+  header->count = count;
+  snprintf(header->pluginUri, sizeof(header->pluginUri), "%s",
+           lilv_node_as_uri(lilv_plugin_get_uri(plugin)));
+  char *bundle =
+      lilv_file_uri_parse(lilv_node_as_uri(lilv_plugin_get_bundle_uri(plugin)),
+                          NULL);
+  if (bundle != NULL) {
+    snprintf(header->bundlePath, sizeof(header->bundlePath), "%s", bundle);
+    lilv_free(bundle);
+  }
+  header->bundleMtime = bundle_mtime(header->bundlePath);
+
+done:
+  free(ranges);
+  lilv_nodes_free(parameters);
+  lilv_node_free(defaultValue);
+  lilv_node_free(maximum);
+  lilv_node_free(minimum);
+  lilv_node_free(range);
+  lilv_node_free(writable);
+  lilv_node_free(inputPort);
+  lilv_node_free(controlPort);
+  return schemas;
+}
+
+// Read the plugin's metadata, NULL when lilv does not know the plugin
+static ControlSchema_t *schema_discover(ThisUI *ui, SchemaHeader_t *header) {
+  LilvWorld *world = lilv_world_new();
+  if (world == NULL)
+    return NULL;
+  lilv_world_load_all(world);
+  LilvNode *uri = lilv_new_uri(world, ui->plugin_uri);
+  const LilvPlugin *plugin =
+      lilv_plugins_get_by_uri(lilv_world_get_all_plugins(world), uri);
+  ControlSchema_t *schemas =
+      plugin != NULL ? schema_collect(world, plugin, header) : NULL;
+  lilv_node_free(uri);
+  lilv_world_free(world);
+  return schemas;
+}
+
+// Written under a temporary name and renamed into place, so instances that
+// start together never map a partial file
+static void schema_store(ThisUI *ui, const char *path,
+                         const SchemaHeader_t *header,
+                         const ControlSchema_t *schemas) {
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s", path);
+  for (char *slash = strchr(directory + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(directory, 0755);
+    *slash = '/';
+  }
+
+  char temporary[PATH_MAX + 16];
+  snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+  FILE *file = fopen(temporary, "wb");
+  bool ok = file != NULL &&
+            fwrite(header, sizeof(SchemaHeader_t), 1, file) == 1 &&
+            fwrite(schemas, sizeof(ControlSchema_t), header->count, file) ==
+                header->count;
+  if (file != NULL && fclose(file) != 0)
+    ok = false;
+  if (!ok || rename(temporary, path) != 0) {
+    unlink(temporary);
+    lv2_log_warning(&ui->logger, "Could not write schema cache %s\n", path);
+  }
+}
+
+// Find the controls of the plugin, from the schema cache when it is current,
+// and index them
+static bool load_controls(ThisUI *ui) {
+  char path[PATH_MAX];
+  bool cacheable = schema_cache_path(ui->plugin_uri, path, sizeof(path));
+  if (!cacheable || !schema_map(ui, path)) {
+    SchemaHeader_t header;
+    ui->discovered = schema_discover(ui, &header);
+    if (ui->discovered != NULL) {
+      if (cacheable && header.bundlePath[0] != '\0')
+        schema_store(ui, path, &header, ui->discovered);
+      ui->schemas = ui->discovered;
+      ui->nmbControls = header.count;
+    } else {
+      ui->schemas = fallbackControls;
+      ui->nmbControls = sizeof(fallbackControls) / sizeof(ControlSchema_t);
+    }
+  }
+
+  uint32_t size = 16;
+  while (size < 2 * ui->nmbControls)
+    size *= 2;
+  ui->controlSlotsMask = size - 1;
+  ui->controlSlots = calloc(size, sizeof(uint32_t));
+  ui->propertySlots = calloc(size, sizeof(uint32_t));
+  ui->controls = calloc(ui->nmbControls + 1, sizeof(Control_t));
+  ui->tickValues = malloc((ui->nmbControls + 1) * sizeof(float));
+  ui->tickChanged = malloc((ui->nmbControls + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < ui->nmbControls; i++) {
+    const ControlSchema_t *schema = &ui->schemas[i];
+    if (schema->type == CONTROL_PORT && schema->port >= ui->nmbPorts)
+      ui->nmbPorts = schema->port + 1;
+  }
+  ui->portControls = calloc(ui->nmbPorts + 1, sizeof(uint32_t));
+  if (ui->controlSlots == NULL || ui->propertySlots == NULL ||
+      ui->controls == NULL ||
+      ui->tickValues == NULL || ui->tickChanged == NULL ||
+      ui->portControls == NULL)
+    return false;
+
+  for (uint32_t i = 0; i < ui->nmbControls; i++) {
+    const ControlSchema_t *schema = &ui->schemas[i];
+    Control_t *control = &ui->controls[i];
+    control->schema = schema;
+    control->symbolLength = strnlen(schema->symbol, SCHEMA_SYMBOL - 1);
+    control->hash = key_hash(schema->symbol, control->symbolLength);
+    if (schema->type != CONTROL_PORT)
+      control->property = ui->map->map(ui->map->handle, schema->uri);
+    else
+      ui->portControls[schema->port] = i + 1;
+    atomic_init(&control->value, schema->defaultValue);
+    atomic_init(&control->pending, NAN);
+    ui->tickValues[i] = NAN;
+
+    uint32_t slot = control->hash & ui->controlSlotsMask;
+    while (ui->controlSlots[slot] != 0)
+      slot = (slot + 1) & ui->controlSlotsMask;
+    ui->controlSlots[slot] = i + 1;
+
+    if (control->property != 0) {
+      slot = control->property * 2654435761u & ui->controlSlotsMask;
+      while (ui->propertySlots[slot] != 0)
+        slot = (slot + 1) & ui->controlSlotsMask;
+      ui->propertySlots[slot] = i + 1;
+    }
+  }
+  return true;
+}
+
+static void free_controls(ThisUI *ui) {
+  if (ui->schemaMap != NULL)
+    munmap(ui->schemaMap, ui->schemaMapLength);
+  free(ui->discovered);
+  free(ui->controls);
+  free(ui->controlSlots);
+  free(ui->propertySlots);
+  free(ui->portControls);
+  free(ui->tickValues);
+  free(ui->tickChanged);
+}
+
+static Control_t *find_control(ThisUI *ui, const char *symbol,
+                               size_t length) {
+  uint32_t hash = key_hash(symbol, length);
+  for (uint32_t slot = hash & ui->controlSlotsMask;
+       ui->controlSlots[slot] != 0;
+       slot = (slot + 1) & ui->controlSlotsMask) {
+    Control_t *control = &ui->controls[ui->controlSlots[slot] - 1];
+    if (control->hash == hash && control->symbolLength == length &&
+        !memcmp(control->schema->symbol, symbol, length))
+      return control;
+  }
+  return NULL;
+}
+
+// The parameter a patch:Set from the plugin is about
+static Control_t *find_property(ThisUI *ui, LV2_URID property) {
+  for (uint32_t slot = property * 2654435761u & ui->controlSlotsMask;
+       ui->propertySlots[slot] != 0;
+       slot = (slot + 1) & ui->controlSlotsMask) {
+    Control_t *control = &ui->controls[ui->propertySlots[slot] - 1];
+    if (control->property == property)
+      return control;
+  }
+  return NULL;
+}
+
+// Clamp to the control's range, false for controls the UI does not set
+static bool control_clamp(const Control_t *control, float *value) {
+  const ControlSchema_t *schema = control->schema;
+  if (schema->type >= CONTROL_PATH || isnan(*value))
+    return false;
+  if (schema->minimum < schema->maximum)
+    *value = fminf(fmaxf(*value, schema->minimum), schema->maximum);
+  if (schema->type == CONTROL_INT || schema->type == CONTROL_LONG)
+    *value = rintf(*value);
+  else if (schema->type == CONTROL_BOOL)
+    *value = *value != 0;
+  return true;
+}
+
+// Whether the process that created the segment name still runs
+static bool channel_in_use(const char *name) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  struct {
+    char magic[8];
+    uint32_t pid;
+  } owner;
+  bool inUse = pread(fd, &owner, sizeof(owner), 0) == sizeof(owner) &&
+               !memcmp(owner.magic, CHANNEL_MAGIC, 8) &&
+               owner.pid != getpid() &&
+               (kill(owner.pid, 0) == 0 || errno == EPERM);
+  close(fd);
+  return inUse;
+}
+
+// Create the instance's control channel, named UI_BRIDGE_SHM followed by the
+// instance name, when UI_BRIDGE_SHM is set. A segment left by a process that
+// is gone is unlinked and a fresh one created, so whoever still maps the old
+// one keeps valid memory; one whose process still runs is left alone.
+static void channel_open(ThisUI *ui) {
+  const char *prefix = getenv("UI_BRIDGE_SHM");
+  if (prefix == NULL || *prefix == '\0')
+    return;
+  size_t length = snprintf(ui->channelName, sizeof(ui->channelName), "%s%s",
+                           prefix, ui->name);
+  if (prefix[0] != '/' || strchr(prefix + 1, '/') != NULL ||
+      length >= sizeof(ui->channelName)) {
+    printf("Error: UI_BRIDGE_SHM is not a shared memory name.\n");
+    return;
+  }
+  int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+  int fd = shm_open(ui->channelName, flags, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    if (channel_in_use(ui->channelName)) {
+      printf("Error: The control channel %s is in use.\n", ui->channelName);
+      return;
+    }
+    shm_unlink(ui->channelName);
+    fd = shm_open(ui->channelName, flags, 0600);
+  }
+  if (fd < 0) {
+    printf("Error: The control channel %s is not created.\n",
+           ui->channelName);
+    return;
+  }
+
+  uint32_t nmbControls = ui->nmbControls;
+  size_t size = sizeof(Channel_t) + nmbControls * sizeof(ChannelControl_t);
+  Channel_t *channel = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    channel = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (channel == MAP_FAILED) {
+    printf("Error: The control channel %s is not mapped.\n", ui->channelName);
+    shm_unlink(ui->channelName);
+    return;
+  }
+  channel->pid = getpid();
+  channel->ringSize = CHANNEL_RING_SIZE;
+  channel->nmbControls = nmbControls;
+  for (uint32_t i = 0; i < nmbControls; i++) {
+    Control_t *control = &ui->controls[i];
+    snprintf(channel->controls[i].name, CHANNEL_NAME, "%s",
+             control->schema->symbol);
+    atomic_init(&channel->controls[i].value,
+                control->schema->type >= CONTROL_PATH
+                    ? NAN
+                    : atomic_load_explicit(&control->value,
+                                           memory_order_relaxed));
+  }
+  atomic_thread_fence(memory_order_release);
+  memcpy(channel->magic, CHANNEL_MAGIC, 8);
+  ui->channel = channel;
+  ui->channelSize = size;
+}
+
+// Readers that mapped the segment keep it, the name goes
+static void channel_close(ThisUI *ui) {
+  if (ui->channel == NULL)
+    return;
+  munmap(ui->channel, ui->channelSize);
+  shm_unlink(ui->channelName);
+  ui->channel = NULL;
+}
+
+static void channel_mirror(ThisUI *ui, uint32_t index, float value) {
+  if (ui->channel != NULL)
+    atomic_store_explicit(&ui->channel->controls[index].value, value,
+                          memory_order_relaxed);
+}
+
+// Ask for path to be loaded, ui_idle sends it to the plugin
+static void sfz_request(ThisUI *ui, const char *path) {
+  pthread_mutex_lock(&ui->sfzLock);
+  SfzLoad_t *load = &ui->sfzLoad;
+  snprintf(load->path, sizeof(load->path), "%s", path);
+  load->state = SFZ_LOADING;
+  load->started = now_ns();
+  load->generation++;
+  atomic_store_explicit(&ui->sfzQueued, true, memory_order_relaxed);
+  pthread_mutex_unlock(&ui->sfzLock);
+}
+
+// A patch:Set of liquidsfz:sfzfile with the latest path asked for
+static void sfz_send(ThisUI *ui) {
+  char path[PATH_MAX];
+  pthread_mutex_lock(&ui->sfzLock);
+  snprintf(path, sizeof(path), "%s", ui->sfzLoad.path);
+  ui->sfzLoad.outstanding++;
+  atomic_store_explicit(&ui->sfzQueued, false, memory_order_relaxed);
+  pthread_mutex_unlock(&ui->sfzLock);
+
+  uint8_t buffer[PATH_MAX + 128];
+  lv2_atom_forge_set_buffer(&ui->forge, buffer, sizeof(buffer));
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom *msg =
+      (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0, ui->patch_Set);
+  lv2_atom_forge_property_head(&ui->forge, ui->patch_property, 0);
+  lv2_atom_forge_urid(&ui->forge, ui->liquidsfz_sfzfile);
+  lv2_atom_forge_property_head(&ui->forge, ui->patch_value, 0);
+  lv2_atom_forge_path(&ui->forge, path, strlen(path));
+  lv2_atom_forge_pop(&ui->forge, &frame);
+
+  ui->write(ui->controller, 0, lv2_atom_total_size(msg), ui->atom_eventTransfer,
+            msg);
+}
+
+// Without a file to load, ask the plugin which one it has, as restored by
+// the host
+static void sfz_query(ThisUI *ui) {
+  lv2_atom_forge_set_buffer(&ui->forge, ui->forge_buf, sizeof(ui->forge_buf));
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom *msg =
+      (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0, ui->patch_Get);
+  lv2_atom_forge_pop(&ui->forge, &frame);
+
+  ui->write(ui->controller, 0, lv2_atom_total_size(msg), ui->atom_eventTransfer,
+            msg);
+}
+
+// The plugin answers every load with the file it then has, the one asked
+// for unless loading failed. A file it reports unasked was restored by the
+// host.
+static void sfz_reported(ThisUI *ui, const char *path, size_t length) {
+  uint64_t now = now_ns();
+  pthread_mutex_lock(&ui->sfzLock);
+  SfzLoad_t *load = &ui->sfzLoad;
+  snprintf(load->loaded, sizeof(load->loaded), "%.*s", (int)length, path);
+  bool queued = atomic_load_explicit(&ui->sfzQueued, memory_order_relaxed);
+  if (load->state != SFZ_LOADING) {
+    snprintf(load->path, sizeof(load->path), "%s", load->loaded);
+    load->state = load->loaded[0] ? SFZ_READY : SFZ_IDLE;
+    load->started = load->finished = now;
+  } else if (!queued && !strcmp(load->path, load->loaded)) {
+    // The plugin may answer loads sent in quick succession only once
+    load->state = SFZ_READY;
+    load->outstanding = 0;
+    load->finished = now;
+    metric_add(&ui->metrics.sfzReady, 1);
+  } else if (load->outstanding > 0 && --load->outstanding == 0 && !queued) {
+    load->state = SFZ_FAILED;
+    load->finished = now;
+    metric_add(&ui->metrics.sfzFailed, 1);
+  }
+  pthread_mutex_unlock(&ui->sfzLock);
+}
+
+// Seconds taken by the load, or so far while it runs
+static double sfz_seconds(const SfzLoad_t *load) {
+  uint64_t end = load->state == SFZ_LOADING ? now_ns() : load->finished;
+  return (end - load->started) / 1e9;
+}
+
+static void server_attach(ThisUI *ui, int port);
+static void server_detach(ThisUI *ui);
 
 static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
                                 const char *plugin_uri, const char *bundle_path,
@@ -168,7 +1176,6 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
   ui->controller = controller;
   sprintf(ui->plugin_uri, "%s", plugin_uri);
   sprintf(ui->static_path, "%sstatic", bundle_path);
-  ui->http_port = atoi(getenv("HTTP_PORT"));
   ui->sfz_filepath = getenv("SFZ_FILEPATH");
 
   // Get host features
@@ -202,6 +1209,9 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
   ui->atom_String = ui->map->map(ui->map->handle, LV2_ATOM__String);
   ui->atom_Int = ui->map->map(ui->map->handle, LV2_ATOM__Int);
   ui->atom_Float = ui->map->map(ui->map->handle, LV2_ATOM__Float);
+  ui->atom_Double = ui->map->map(ui->map->handle, LV2_ATOM__Double);
+  ui->atom_Long = ui->map->map(ui->map->handle, LV2_ATOM__Long);
+  ui->atom_Bool = ui->map->map(ui->map->handle, LV2_ATOM__Bool);
   ui->atom_URID = ui->map->map(ui->map->handle, LV2_ATOM__URID);
   ui->atom_Path = ui->map->map(ui->map->handle, LV2_ATOM__Path);
   ui->midi_MidiEvent = ui->map->map(ui->map->handle, LV2_MIDI__MidiEvent);
@@ -222,6 +1232,13 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
 */
  ui->liquidsfz_sfzfile  = ui->map->map (ui->map->handle, LIQUIDSFZ_URI "#sfzfile");
 
+  if (!load_controls(ui)) {
+    lv2_log_error(&ui->logger, "Out of memory for the control table\n");
+    free_controls(ui);
+    free(ui);
+    return NULL;
+  }
+
 /*
   ui->pluginControls = calloc(nmbControlKeys, sizeof(PluginControl_t));
   for (int i = 0; i < nmbControlKeys; i++) {
@@ -238,27 +1255,24 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
 
   lv2_atom_forge_init(&ui->forge, ui->map);
 
-  int k = pthread_create(&ui->t_http_server, NULL, http_server_run, ui);
-  if (k != 0) {
-    fprintf(stderr, "%d : %s\n", k, "pthread_create : HTTPServer thread");fflush(stderr);
+  pthread_mutex_init(&ui->queueLock, NULL);
+  pthread_mutex_init(&ui->sfzLock, NULL);
+  const char *portText = getenv("HTTP_PORT");
+  int port = portText != NULL ? atoi(portText) : 0;
+  if (port <= 0 || port > 65535) {
+    printf("Error: HTTP_PORT is not a port, %d is served.\n",
+           DEFAULT_HTTP_PORT);
+    port = DEFAULT_HTTP_PORT;
+  }
+  server_attach(ui, port);
+  channel_open(ui);
+
+  if (ui->sfz_filepath != NULL && ui->sfz_filepath[0] != '\0') {
+    sfz_request(ui, ui->sfz_filepath);
+    sfz_send(ui);
+  } else {
+    sfz_query(ui);
   }
-
-  uint8_t obj_buf[400];
-  lv2_atom_forge_set_buffer(&ui->forge, obj_buf, 400);
-
-  LV2_Atom_Forge_Frame frame;
-  lv2_atom_forge_frame_time(&ui->forge, 0);
-
-  LV2_Atom *msg = (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0, ui->patch_Set);
-
-  lv2_atom_forge_property_head (&ui->forge, ui->patch_property, 0);
-  lv2_atom_forge_urid (&ui->forge, ui->liquidsfz_sfzfile);
-  lv2_atom_forge_property_head (&ui->forge, ui->patch_value, 0);
-  lv2_atom_forge_path (&ui->forge, ui->sfz_filepath, strlen(ui->sfz_filepath));
-  lv2_atom_forge_pop(&ui->forge, &frame);
-
-  ui->write(ui->controller, 0, lv2_atom_total_size(msg), ui->atom_eventTransfer,
-            msg);
 
   return ui;
 }
@@ -267,16 +1281,79 @@ static LV2UI_Handle instantiate(const LV2UI_Descriptor *descriptor,
 static void cleanup(LV2UI_Handle handle) {
   ThisUI *ui = (ThisUI *)handle;
 
-  pthread_join(ui->t_http_server, NULL);
-  close(ui->clientSocket);
-  close(ui->serverSocket);
-  if (ui->request != NULL)
-    free(ui->request);
+  server_detach(ui);
+  channel_close(ui);
+  pthread_mutex_destroy(&ui->sfzLock);
+  pthread_mutex_destroy(&ui->queueLock);
+  free_controls(ui);
 
 //  free(ui->pluginControls);
   free(ui);
 }
 
+static bool buffer_append(Buffer_t *buffer, const void *data, size_t length) {
+  if (buffer->length + length > buffer->size) {
+    size_t size = buffer->size ? buffer->size : SIZE;
+    while (size < buffer->length + length)
+      size *= 2;
+    bool inArena = buffer->data == buffer->arena;
+    char *grown = inArena ? malloc(size) : realloc(buffer->data, size);
+    if (grown == NULL)
+      return false;
+    if (inArena && buffer->length > 0)
+      memcpy(grown, buffer->data, buffer->length);
+    buffer->data = grown;
+    buffer->size = size;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return true;
+}
+
+// Empty the buffer and move it back into its arena
+static void buffer_recycle(Buffer_t *buffer) {
+  if (buffer->data != buffer->arena)
+    free(buffer->data);
+  buffer->data = buffer->arena;
+  buffer->size = buffer->arenaSize;
+  buffer->length = 0;
+}
+
+static bool buffer_printf(Buffer_t *buffer, const char *format, ...) {
+  char text[200];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (length < 0)
+    return false;
+  return buffer_append(buffer, text,
+                       (size_t)length < sizeof(text) ? (size_t)length
+                                                      : sizeof(text) - 1);
+}
+
+// Queue the body built so far as a complete response
+static void conn_respond(Connection_t *conn, const char *status,
+                         const char *contentType) {
+  Buffer_t *response = &conn->response;
+  if (!strncmp(status, "404", 3))
+    metric_add(&conn->metrics->notFound, 1);
+  bool ok = buffer_printf(response,
+                          "HTTP/1.1 %s\r\nAccess-Control-Allow-Origin: *\r\n",
+                          status);
+  if (contentType != NULL)
+    ok = ok && buffer_printf(response, "Content-Type: %s\r\n", contentType);
+  ok = ok && buffer_printf(response, "Content-Length: %zu\r\n%s\r\n",
+                           conn->body.length,
+                           conn->keepAlive ? "" : "Connection: close\r\n");
+  ok = ok && buffer_append(response, conn->body.data, conn->body.length);
+  conn->body.length = 0;
+  if (!ok)
+    conn->state = CONN_CLOSING;
+  if (!conn->keepAlive)
+    conn->closeAfterWrite = true;
+}
+
 /*
 static void sendControls(ThisUI *ui) {
     char response[200];
@@ -358,12 +1435,59 @@ static void an_object(ThisUI *ui, uint32_t port_index, LV2_Atom_Object *obj) {
 }
 */
 
+// A patch:Set from the plugin, for one of its parameters
+static void parameter_changed(ThisUI *ui, LV2_Atom_Object *obj) {
+  const LV2_Atom_URID *property = NULL;
+  const LV2_Atom *value = NULL;
+  lv2_atom_object_get(obj, ui->patch_property, &property, ui->patch_value,
+                      &value, 0);
+  if (property == NULL || property->atom.type != ui->atom_URID ||
+      value == NULL)
+    return;
+
+  if (property->body == ui->liquidsfz_sfzfile) {
+    if (value->type == ui->atom_Path || value->type == ui->atom_String)
+      sfz_reported(ui, LV2_ATOM_BODY_CONST(value),
+                   strnlen(LV2_ATOM_BODY_CONST(value), value->size));
+    return;
+  }
+
+  float number;
+  if (value->type == ui->atom_Float)
+    number = ((const LV2_Atom_Float *)value)->body;
+  else if (value->type == ui->atom_Double)
+    number = ((const LV2_Atom_Double *)value)->body;
+  else if (value->type == ui->atom_Int)
+    number = ((const LV2_Atom_Int *)value)->body;
+  else if (value->type == ui->atom_Long)
+    number = ((const LV2_Atom_Long *)value)->body;
+  else if (value->type == ui->atom_Bool)
+    number = ((const LV2_Atom_Bool *)value)->body != 0;
+  else
+    return;
+
+  Control_t *control = find_property(ui, property->body);
+  if (control != NULL) {
+    atomic_store_explicit(&control->value, number, memory_order_relaxed);
+    channel_mirror(ui, control - ui->controls, number);
+  }
+}
+
 static void port_event(LV2UI_Handle handle, uint32_t port_index,
                        uint32_t buffer_size, uint32_t format,
                        const void *buffer) {
   ThisUI *ui = (ThisUI *)handle;
-  if (!format)
+  if (!format) {
+    // Control port values as the plugin has them
+    if (buffer_size == sizeof(float) && port_index < ui->nmbPorts &&
+        ui->portControls[port_index] != 0) {
+      Control_t *control = &ui->controls[ui->portControls[port_index] - 1];
+      atomic_store_explicit(&control->value, *(const float *)buffer,
+                            memory_order_relaxed);
+      channel_mirror(ui, control - ui->controls, *(const float *)buffer);
+    }
     return;
+  }
 
   if (format != ui->atom_eventTransfer) {
     fprintf(stdout,
@@ -385,14 +1509,137 @@ static void port_event(LV2UI_Handle handle, uint32_t port_index,
     return;
   }
 
-//  LV2_Atom_Object *obj = (LV2_Atom_Object *)atom;
+  LV2_Atom_Object *obj = (LV2_Atom_Object *)atom;
 
+  if (obj->body.otype == ui->patch_Set)
+    parameter_changed(ui, obj);
 //  an_object(ui, port_index, obj);
 }
 
+// Only the latest value of a control within one idle tick is sent
+static void stage_change(ThisUI *ui, uint32_t index, float value) {
+  if (isnan(ui->tickValues[index]))
+    ui->tickChanged[ui->tickChangedCount++] = index;
+  ui->tickValues[index] = value;
+}
+
+// Ports take the value directly, parameters as a patch:Set of their type
+static void write_control(ThisUI *ui, Control_t *control, float value) {
+  const ControlSchema_t *schema = control->schema;
+  if (schema->type == CONTROL_PORT) {
+    ui->write(ui->controller, schema->port, sizeof(float), 0, &value);
+    return;
+  }
+
+  lv2_atom_forge_set_buffer(&ui->forge, ui->forge_buf, sizeof(ui->forge_buf));
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom *msg =
+      (LV2_Atom *)lv2_atom_forge_object(&ui->forge, &frame, 0, ui->patch_Set);
+  lv2_atom_forge_property_head(&ui->forge, ui->patch_property, 0);
+  lv2_atom_forge_urid(&ui->forge, control->property);
+  lv2_atom_forge_property_head(&ui->forge, ui->patch_value, 0);
+  switch (schema->type) {
+  case CONTROL_DOUBLE:
+    lv2_atom_forge_double(&ui->forge, value);
+    break;
+  case CONTROL_INT:
+    lv2_atom_forge_int(&ui->forge, lrintf(value));
+    break;
+  case CONTROL_LONG:
+    lv2_atom_forge_long(&ui->forge, lrintf(value));
+    break;
+  case CONTROL_BOOL:
+    lv2_atom_forge_bool(&ui->forge, value != 0);
+    break;
+  default:
+    lv2_atom_forge_float(&ui->forge, value);
+  }
+  lv2_atom_forge_pop(&ui->forge, &frame);
+
+  ui->write(ui->controller, 0, lv2_atom_total_size(msg), ui->atom_eventTransfer,
+            msg);
+}
+
+// Stage what an external process wrote to the control channel, values
+// clamped as by /control
+static void channel_drain(ThisUI *ui) {
+  Channel_t *channel = ui->channel;
+  if (channel == NULL)
+    return;
+  uint32_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&channel->head, memory_order_acquire);
+  if (head == tail)
+    return;
+  uint64_t overrun = 0;
+  if (head - tail > CHANNEL_RING_SIZE) { // a writer that overran the ring
+    overrun = head - tail - CHANNEL_RING_SIZE;
+    tail = head - CHANNEL_RING_SIZE;
+  }
+  uint64_t applied = 0, rejected = 0;
+  for (; tail != head; tail++) {
+    uint64_t word = atomic_load_explicit(
+        &channel->ring[tail % CHANNEL_RING_SIZE], memory_order_relaxed);
+    // Rewritten meanwhile when the writer has since come a ring round
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&channel->head, memory_order_relaxed) - tail >=
+        CHANNEL_RING_SIZE) {
+      overrun++;
+      continue;
+    }
+    ChannelRecord_t record;
+    memcpy(&record, &word, sizeof(record));
+    float value = record.value;
+    if (record.control >= ui->nmbControls ||
+        !control_clamp(&ui->controls[record.control], &value)) {
+      rejected++;
+      continue;
+    }
+    atomic_store_explicit(&ui->controls[record.control].value, value,
+                          memory_order_relaxed);
+    stage_change(ui, record.control, value);
+    applied++;
+  }
+  atomic_store_explicit(&channel->tail, tail, memory_order_release);
+  metric_add(&ui->metrics.channelApplied, applied);
+  metric_add(&ui->metrics.channelRejected, rejected);
+  metric_add(&ui->metrics.channelOverrun, overrun);
+}
+
 /* Idle interface for UI. */
 static int ui_idle(LV2UI_Handle handle) {
-//  ThisUI *ui = (ThisUI *)handle;
+  ThisUI *ui = (ThisUI *)handle;
+
+  ControlChange_t change;
+  while (ring_pop(&ui->changeRing, &change)) {
+    // Read after the pop, so a change queued meanwhile cannot be newer
+    histogram_record(&ui->metrics.queueTime, now_ns() - change.queued);
+    stage_change(ui, change.control, change.value);
+  }
+
+  // Changes that arrived while the ring was full, latest value per control.
+  // They are newer than anything that was in the ring.
+  if (atomic_exchange_explicit(&ui->changesCoalesced, false,
+                               memory_order_acquire)) {
+    for (uint32_t i = 0; i < ui->nmbControls; i++) {
+      float pending = atomic_exchange_explicit(&ui->controls[i].pending, NAN,
+                                               memory_order_relaxed);
+      if (!isnan(pending))
+        stage_change(ui, i, pending);
+    }
+  }
+
+  channel_drain(ui);
+
+  if (atomic_load_explicit(&ui->sfzQueued, memory_order_relaxed))
+    sfz_send(ui);
+
+  for (uint32_t i = 0; i < ui->tickChangedCount; i++) {
+    uint32_t index = ui->tickChanged[i];
+    write_control(ui, &ui->controls[index], ui->tickValues[index]);
+    channel_mirror(ui, index, ui->tickValues[index]);
+    ui->tickValues[index] = NAN;
+  }
+  ui->tickChangedCount = 0;
 /*
   for (PluginControl_t *control = ui->pluginControls; control->key != NULL;
        control++) {
@@ -466,146 +1713,1564 @@ LV2_SYMBOL_EXPORT const LV2UI_Descriptor *lv2ui_descriptor(uint32_t index) {
   return index == 0 ? &descriptor : NULL;
 }
 
-static void handleSignal(int signal) {}
-
-#define MTU_SIZE 1500
-static void send_file_to_socket(char *filepath, int socket) {
-  FILE *file = fopen(filepath, "rb");
-  if (file == NULL) {
-    char *stat404 = "HTTP/1.1 404 Not Found\r\n\r\n";
-    send(socket, stat404, strlen(stat404), 0);
-    return;
+static const char *mime_type(const char *path) {
+  static const char *types[][2] = {
+      {".html", "text/html; charset=utf-8"},
+      {".js", "text/javascript; charset=utf-8"},
+      {".mjs", "text/javascript; charset=utf-8"},
+      {".css", "text/css; charset=utf-8"},
+      {".json", "application/json"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".ico", "image/x-icon"},
+      {".wasm", "application/wasm"},
+      {".woff2", "font/woff2"},
+      {".txt", "text/plain; charset=utf-8"},
+      {NULL, NULL}};
+  const char *extension = strrchr(path, '.');
+  for (int i = 0; extension != NULL && types[i][0] != NULL; i++) {
+    if (!strcasecmp(extension, types[i][0]))
+      return types[i][1];
   }
-  char *prefix = "HTTP/1.1 200 OK\r\n\r\n";
-  send(socket, prefix, strlen(prefix), 0);
-  unsigned char mtu[MTU_SIZE];
-  int bytes_read;
+  return "application/octet-stream";
+}
 
-  while ((bytes_read = fread(mtu, 1, MTU_SIZE, file)) > 0) {
-    if (send(socket, mtu, bytes_read, 0) < bytes_read) {
-      printf("\nError sending file data to client");
-      fflush(stdout);
-    }
-  }
+static bool read_file(const char *path, char *body, size_t length) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  bool ok = fread(body, 1, length, file) == length;
   fclose(file);
+  return ok;
 }
 
-static void *http_server_run(void *inst) {
-  ThisUI *ui = (ThisUI *)inst;
-
-  signal(SIGINT, handleSignal);
-
-  struct sockaddr_in serverAddress;
-  serverAddress.sin_family = AF_INET; // IPv4
-  serverAddress.sin_port =
-      htons(ui->http_port); // port number in network byte order
-                            // (host-to-network short)
-  serverAddress.sin_addr.s_addr =
-      htonl(INADDR_ANY); // localhost (host to network long)
+// Load the files below directory, served under route
+static void load_static_files(const char *directory, const char *route) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL)
+    return;
 
-  ui->serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
 
-  setsockopt(ui->serverSocket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
-             sizeof(int));
+    char path[PATH_MAX];
+    char entryRoute[100];
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >=
+            (int)sizeof(path) ||
+        snprintf(entryRoute, sizeof(entryRoute), "%s/%s", route,
+                 entry->d_name) >= (int)sizeof(entryRoute) ||
+        stat(path, &st) < 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      load_static_files(path, entryRoute);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode))
+      continue;
 
-  if (bind(ui->serverSocket, (struct sockaddr *)&serverAddress,
-           sizeof(serverAddress)) < 0) {
-    printf("Error: The server is not bound to the address.\n");
-    return NULL;
+    StaticFile_t *file = calloc(1, sizeof(StaticFile_t));
+    if (file == NULL)
+      break;
+    strcpy(file->route, entryRoute);
+    strcpy(file->path, path);
+    file->length = st.st_size;
+    if (file->length <= MAX_CACHED_FILE) {
+      file->body = malloc(file->length ? file->length : 1);
+      if (file->body == NULL || !read_file(path, file->body, file->length)) {
+        free(file->body);
+        free(file);
+        continue;
+      }
+    }
+    file->mimeType = mime_type(path);
+    file->mtime = st.st_mtime;
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%zx\"",
+             (unsigned long)st.st_mtime, file->length);
+    file->next = server.staticFiles;
+    server.staticFiles = file;
   }
+  closedir(dir);
+}
 
-  if (listen(ui->serverSocket, BACKLOG) < 0) {
-    printf("Error: The server is not listening.\n");
-    return NULL;
+static StaticFile_t *find_static_file(const char *route, size_t length) {
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    if (strlen(file->route) == length && !strncmp(file->route, route, length))
+      return file;
   }
+  return NULL;
+}
 
-  while (1) {
-    ui->request = (char *)malloc(SIZE * sizeof(char));
-    char method[10], route[100];
-//    char resource_string[50];
-//    unsigned int resource_uint;
+// Attach .gz/.br sidecars to the file they compress, then build the header
+// blocks sent with every reply
+static void prepare_static_files(void) {
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    size_t length = strlen(file->route);
+    if (length < 4)
+      continue;
+    const char *suffix = file->route + length - 3;
+    bool gzip = !strcmp(suffix, ".gz");
+    if (!gzip && strcmp(suffix, ".br"))
+      continue;
+    StaticFile_t *original = find_static_file(file->route, length - 3);
+    if (original == NULL)
+      continue;
+    if (gzip)
+      original->gzip = file;
+    else
+      original->brotli = file;
+    file->encoding = gzip ? "gzip" : "br";
+    file->mimeType = original->mimeType;
+  }
 
-    ui->clientSocket = accept(ui->serverSocket, NULL, NULL);
-    read(ui->clientSocket, ui->request, SIZE);
+  for (StaticFile_t *file = server.staticFiles; file != NULL;
+       file = file->next) {
+    char lastModified[40];
+    struct tm tm;
+    strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&file->mtime, &tm));
+    const char *vary = file->encoding || file->gzip || file->brotli
+                           ? "Vary: Accept-Encoding\r\n"
+                           : "";
+    file->notModifiedLength = snprintf(
+        file->notModified, sizeof(file->notModified),
+        "HTTP/1.1 304 Not Modified\r\nAccess-Control-Allow-Origin: *\r\n"
+        "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n%s",
+        file->etag, lastModified, vary);
+    file->headerLength = snprintf(
+        file->headers, sizeof(file->headers),
+        "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n"
+        "Content-Type: %s\r\nContent-Length: %zu\r\n%s%s%s"
+        "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n%s",
+        file->mimeType, file->length, file->encoding ? "Content-Encoding: " : "",
+        file->encoding ? file->encoding : "", file->encoding ? "\r\n" : "",
+        file->etag, lastModified, vary);
+  }
+}
 
-    sscanf(ui->request, "%s %s", method, route);
+static void free_static_files(void) {
+  while (server.staticFiles != NULL) {
+    StaticFile_t *file = server.staticFiles;
+    server.staticFiles = file->next;
+    free(file->body);
+    free(file);
+  }
+}
 
-    free(ui->request);
+// Whether an If-None-Match list names etag or is "*". Tags are compared
+// whole, so weak W/ tags and substrings of others do not match.
+static bool etag_listed(const char *list, const char *etag) {
+  size_t length = strlen(etag);
+  while (*list != '\0') {
+    list += strspn(list, " \t,");
+    size_t tag = strcspn(list, ",");
+    size_t trimmed = tag;
+    while (trimmed > 0 &&
+           (list[trimmed - 1] == ' ' || list[trimmed - 1] == '\t'))
+      trimmed--;
+    if ((trimmed == length && !strncmp(list, etag, length)) ||
+        (trimmed == 1 && *list == '*'))
+      return true;
+    list += tag;
+  }
+  return false;
+}
 
-    if (strcmp(method, "GET") != 0) {
-      const char response[] =
-          "HTTP/1.1 400 Bad Request\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
-      send(ui->clientSocket, response, strlen(response), 0);
+// Only files found at startup are served, so routes cannot escape
+// static_path
+static void send_static_file(Connection_t *conn, HttpRequest_t *request,
+                             const char *route) {
+  const StaticFile_t *file = find_static_file(route, strlen(route));
+  if (file == NULL || file->encoding != NULL) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+  if (request->acceptBrotli && file->brotli != NULL)
+    file = file->brotli;
+  else if (request->acceptGzip && file->gzip != NULL)
+    file = file->gzip;
+
+  // If-None-Match takes precedence over If-Modified-Since
+  bool notModified =
+      request->ifNoneMatch != NULL
+          ? etag_listed(request->ifNoneMatch, file->etag)
+          : request->ifModifiedSince != -1 &&
+                file->mtime <= request->ifModifiedSince;
+  if (notModified) {
+    if (!buffer_append(&conn->response, file->notModified,
+                       file->notModifiedLength) ||
+        !buffer_printf(&conn->response, "%s\r\n",
+                       conn->keepAlive ? "" : "Connection: close\r\n"))
+      conn->state = CONN_CLOSING;
+    if (!conn->keepAlive)
+      conn->closeAfterWrite = true;
+    return;
+  }
+
+  if (file->body == NULL) {
+    conn->fileFd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (conn->fileFd < 0) {
+      conn_respond(conn, "404 Not Found", NULL);
+      return;
+    }
+  }
+  if (!buffer_append(&conn->response, file->headers, file->headerLength) ||
+      !buffer_printf(&conn->response, "%s\r\n",
+                     conn->keepAlive ? "" : "Connection: close\r\n"))
+    conn->state = CONN_CLOSING;
+  conn->file = file;
+  conn->fileSent = 0;
+  if (!conn->keepAlive)
+    conn->closeAfterWrite = true;
+}
+
+static void release_file(Connection_t *conn) {
+  if (conn->fileFd >= 0)
+    close(conn->fileFd);
+  conn->fileFd = -1;
+  conn->file = NULL;
+  conn->fileSent = 0;
+}
+
+// Exported with the same bounds on every scrape, each power of two from
+// about 1 us, so the series stay stable for rate() and histogram_quantile()
+static void histogram_text(Buffer_t *out, const char *name, const char *help,
+                           Histogram_t *histogram) {
+  buffer_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    total += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    unsigned int last = (1 << HISTOGRAM_SUB_BITS) - 1;
+    if ((i & last) != last || histogram_bound(i) < 1000)
+      continue;
+    buffer_printf(out, "%s_bucket{le=\"%.9f\"} %llu\n", name,
+                  histogram_bound(i) / 1e9, (unsigned long long)total);
+  }
+  total += atomic_load_explicit(&histogram->counts[HISTOGRAM_BUCKETS - 1],
+                                memory_order_relaxed);
+  buffer_printf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)total);
+  buffer_printf(
+      out, "%s_sum %.9f\n%s_count %llu\n", name,
+      atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e9, name,
+      (unsigned long long)total);
+}
+
+// Prometheus text exposition format. Connections, bytes sent and parse time
+// are the server's, shared by all instances.
+static void metrics_text(ThisUI *ui, Buffer_t *out) {
+  Metrics_t *metrics = &ui->metrics;
+  buffer_printf(out, "# HELP uiweb_http_requests_total HTTP requests by "
+                     "route.\n# TYPE uiweb_http_requests_total counter\n");
+  for (unsigned int i = 0; i < ROUTE_LABELS; i++)
+    buffer_printf(out, "uiweb_http_requests_total{route=\"%s\"} %llu\n",
+                  routeLabels[i][1],
+                  (unsigned long long)atomic_load_explicit(
+                      &metrics->requests[i], memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_not_found_total Replies with status 404.\n"
+                "# TYPE uiweb_http_not_found_total counter\n"
+                "uiweb_http_not_found_total %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->notFound, memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_sent_bytes_total Bytes written to clients.\n"
+                "# TYPE uiweb_http_sent_bytes_total counter\n"
+                "uiweb_http_sent_bytes_total %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &server.metrics.bytesSent, memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_http_connections Open client connections.\n"
+                "# TYPE uiweb_http_connections gauge\n"
+                "uiweb_http_connections %lld\n",
+                (long long)atomic_load_explicit(&server.metrics.connections,
+                                                memory_order_relaxed));
+  buffer_printf(out, "# HELP uiweb_osc_messages_total OSC messages received, "
+                     "rejected ones are counted for the server.\n"
+                     "# TYPE uiweb_osc_messages_total counter\n");
+  buffer_printf(out,
+                "uiweb_osc_messages_total{result=\"applied\"} %llu\n"
+                "uiweb_osc_messages_total{result=\"rejected\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->oscApplied, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(
+                    &server.metrics.oscRejected, memory_order_relaxed));
+  buffer_printf(out, "# HELP uiweb_shm_records_total Control channel records "
+                     "consumed.\n"
+                     "# TYPE uiweb_shm_records_total counter\n");
+  buffer_printf(out,
+                "uiweb_shm_records_total{result=\"applied\"} %llu\n"
+                "uiweb_shm_records_total{result=\"rejected\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelApplied, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelRejected, memory_order_relaxed));
+  buffer_printf(out, "uiweb_shm_records_total{result=\"overrun\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->channelOverrun, memory_order_relaxed));
+  pthread_mutex_lock(&ui->sfzLock);
+  double sfzSeconds = sfz_seconds(&ui->sfzLoad);
+  pthread_mutex_unlock(&ui->sfzLock);
+  buffer_printf(out, "# HELP uiweb_sfz_loads_total SFZ loads answered by "
+                     "the plugin.\n"
+                     "# TYPE uiweb_sfz_loads_total counter\n");
+  buffer_printf(out,
+                "uiweb_sfz_loads_total{result=\"ready\"} %llu\n"
+                "uiweb_sfz_loads_total{result=\"failed\"} %llu\n",
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->sfzReady, memory_order_relaxed),
+                (unsigned long long)atomic_load_explicit(
+                    &metrics->sfzFailed, memory_order_relaxed));
+  buffer_printf(out,
+                "# HELP uiweb_sfz_load_seconds Time the last SFZ load took, "
+                "or has taken so far.\n"
+                "# TYPE uiweb_sfz_load_seconds gauge\n"
+                "uiweb_sfz_load_seconds %.3f\n",
+                sfzSeconds);
+  histogram_text(out, "uiweb_request_parse_seconds",
+                 "Time to parse a request header block.",
+                 &server.metrics.parseTime);
+  histogram_text(out, "uiweb_change_queued_seconds",
+                 "Time a control change waits for ui_idle.",
+                 &metrics->queueTime);
+}
+
+static const char *controlTypes[] = {"port", "float", "double", "int",
+                                     "long", "bool",  "path",   "string"};
+
+// Current values by symbol, null for parameters the UI does not set
+static void controls_json(ThisUI *ui, Buffer_t *out) {
+  buffer_append(out, "{", 1);
+  for (uint32_t i = 0; i < ui->nmbControls; i++) {
+    Control_t *control = &ui->controls[i];
+    buffer_printf(out, "%s\"%s\": ", i ? "," : "", control->schema->symbol);
+    if (control->schema->type >= CONTROL_PATH)
+      buffer_append(out, "null", 4);
+    else
+      buffer_printf(out, "%g", atomic_load_explicit(&control->value,
+                                                    memory_order_relaxed));
+  }
+  buffer_append(out, "}", 1);
+}
+
+// What a generic UI needs to lay out the controls
+static void schema_json(ThisUI *ui, Buffer_t *out) {
+  buffer_append(out, "[", 1);
+  for (uint32_t i = 0; i < ui->nmbControls; i++) {
+    const ControlSchema_t *schema = &ui->schemas[i];
+    buffer_printf(out, "%s{\"symbol\": \"%s\", \"type\": \"%s\"",
+                  i ? "," : "", schema->symbol, controlTypes[schema->type]);
+    if (schema->type == CONTROL_PORT)
+      buffer_printf(out, ", \"port\": %u", schema->port);
+    else
+      buffer_printf(out, ", \"uri\": \"%s\"", schema->uri);
+    buffer_printf(out, ", \"minimum\": %g, \"maximum\": %g, \"default\": %g}",
+                  schema->minimum, schema->maximum, schema->defaultValue);
+  }
+  buffer_append(out, "]", 1);
+}
+
+// Clamp to the control's range and hand the value to ui_idle
+static void change_control(ThisUI *ui, Connection_t *conn, Control_t *control,
+                           float value) {
+  if (control == NULL) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+  if (!control_clamp(control, &value)) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
+  atomic_store_explicit(&control->value, value, memory_order_relaxed);
+  queue_change(ui, control - ui->controls, value);
+  buffer_printf(&conn->body, "%g", value);
+  conn_respond(conn, "200 OK", NULL);
+}
+
+// File names may hold quotes and control characters
+static void json_text(Buffer_t *out, const char *text) {
+  buffer_append(out, "\"", 1);
+  const char *run = text;
+  for (; *text != '\0'; text++) {
+    unsigned char c = *text;
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    buffer_append(out, run, text - run);
+    buffer_printf(out, "\\u%04x", c);
+    run = text + 1;
+  }
+  buffer_append(out, run, text - run);
+  buffer_append(out, "\"", 1);
+}
+
+static const char *sfzStates[] = {"idle", "loading", "ready", "failed"};
+
+static SfzState_t sfz_json(ThisUI *ui, Buffer_t *out) {
+  SfzLoad_t load;
+  pthread_mutex_lock(&ui->sfzLock);
+  load = ui->sfzLoad;
+  pthread_mutex_unlock(&ui->sfzLock);
+  buffer_printf(out, "{\"state\": \"%s\", \"path\": ", sfzStates[load.state]);
+  json_text(out, load.path);
+  buffer_append(out, ", \"loaded\": ", 12);
+  json_text(out, load.loaded);
+  buffer_printf(out, ", \"seconds\": %.3f, \"generation\": %u}",
+                sfz_seconds(&load), load.generation);
+  return load.state;
+}
+
+// Decode %XX escapes in place, false for malformed ones and NUL bytes
+static bool percent_decode(char *text) {
+  char *out = text;
+  for (; *text != '\0'; text++) {
+    if (*text != '%') {
+      *out++ = *text;
       continue;
     }
+    if (!isxdigit((unsigned char)text[1]) ||
+        !isxdigit((unsigned char)text[2]))
+      return false;
+    char hex[3] = {text[1], text[2], '\0'};
+    *out = strtol(hex, NULL, 16);
+    if (*out++ == '\0')
+      return false;
+    text += 2;
+  }
+  *out = '\0';
+  return true;
+}
 
-//    if (sscanf(route, "/control/%u/%s", &resource_uint, resource_string) == 2) {
-      /*
-      PluginControl_t *pluginControl = getPluginControl(ui, resource_string);
-      if (pluginControl != NULL) {
-        pluginControl->value = resource_uint;
-        pluginControl->changed = true;
-        char response[200];
-        sprintf(response,
-                "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\n%d",
-                pluginControl->value);
-        send(ui->clientSocket, response, strlen(response), 0);
-      } else {
-        char *stat404 = "HTTP/1.1 404 Not Found\r\n\r\n";
-        send(ui->clientSocket, stat404, strlen(stat404), 0);
+// Load another SFZ file, named by its absolute path. It is resolved here,
+// so a missing file is refused at once and the plugin's answer can be
+// matched with it.
+static void sfz_load(ThisUI *ui, Connection_t *conn, char *path) {
+  char resolved[PATH_MAX];
+  struct stat st;
+  if (!percent_decode(path)) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
+  if (realpath(path, resolved) == NULL || stat(resolved, &st) != 0 ||
+      !S_ISREG(st.st_mode)) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+  sfz_request(ui, resolved);
+  sfz_json(ui, &conn->body);
+  conn_respond(conn, "202 Accepted", "application/json");
+}
+
+static void count_request(ThisUI *ui, const char *route) {
+  for (unsigned int i = 0; i < ROUTE_LABELS; i++) {
+    if (!strncmp(route, routeLabels[i][0], strlen(routeLabels[i][0]))) {
+      metric_add(&ui->metrics.requests[i], 1);
+      return;
+    }
+  }
+}
+
+static void handle_request(ThisUI *ui, Connection_t *conn,
+                           HttpRequest_t *request) {
+  char *route = request->route;
+
+  count_request(ui, route);
+
+  if (strcmp(request->method, "GET") != 0) {
+    conn_respond(conn, "400 Bad Request", NULL);
+    return;
+  }
+
+  char symbol[SCHEMA_SYMBOL];
+  float value;
+  if (sscanf(route, "/control/%f/%63s", &value, symbol) == 2) {
+    change_control(ui, conn, find_control(ui, symbol, strlen(symbol)), value);
+    return;
+  }
+
+  if (!strcmp(route, "/controls")) {
+    controls_json(ui, &conn->body);
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  if (!strcmp(route, "/schema")) {
+    schema_json(ui, &conn->body);
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  if (sscanf(route, "/level/%f", &value) == 1) {
+    change_control(ui, conn, find_control(ui, "level", 5), value);
+    return;
+  }
+
+  if (!strcmp(route, "/sfz")) {
+    sfz_json(ui, &conn->body);
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  // For clients waiting on the sound set: 503 until it is loaded
+  if (!strcmp(route, "/sfz/ready")) {
+    SfzState_t state = sfz_json(ui, &conn->body);
+    conn_respond(conn,
+                 state == SFZ_READY    ? "200 OK"
+                 : state == SFZ_FAILED ? "500 Internal Server Error"
+                                       : "503 Service Unavailable",
+                 "application/json");
+    return;
+  }
+
+  if (!strncmp(route, "/sfz/load/", 10)) {
+    sfz_load(ui, conn, route + 9);
+    return;
+  }
+
+  if (!strcmp(route, "/metrics")) {
+    metrics_text(ui, &conn->body);
+    conn_respond(conn, "200 OK", "text/plain; version=0.0.4");
+    return;
+  }
+
+  send_static_file(conn, request, strcmp(route, "/") ? route : "/index.html");
+}
+
+// Caller holds server.lock
+static ThisUI *find_instance(const char *name, size_t length) {
+  for (ThisUI *ui = server.instances; ui != NULL; ui = ui->nextInstance) {
+    if (strlen(ui->name) == length && !strncmp(ui->name, name, length))
+      return ui;
+  }
+  return NULL;
+}
+
+static void instances_json(Buffer_t *out) {
+  buffer_append(out, "[", 1);
+  pthread_mutex_lock(&server.lock);
+  for (ThisUI *ui = server.instances; ui != NULL; ui = ui->nextInstance)
+    buffer_printf(out, "%s\"%s\"", ui == server.instances ? "" : ",",
+                  ui->name);
+  pthread_mutex_unlock(&server.lock);
+  buffer_append(out, "]", 1);
+}
+
+// Requests under /i/<name>/ go to that instance and any other route to the
+// instance whose Unix-domain socket the client connected to, or else to the
+// first one, so a process with a single instance is served as before
+static void route_request(Connection_t *conn, HttpRequest_t *request) {
+  char *route = request->route;
+  if (!strcmp(request->method, "GET") && !strcmp(route, "/instances")) {
+    instances_json(&conn->body);
+    conn_respond(conn, "200 OK", "application/json");
+    return;
+  }
+
+  bool prefixed = !strncmp(route, "/i/", 3);
+  size_t length = prefixed ? strcspn(route + 3, "/?") : 0;
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = prefixed                ? find_instance(route + 3, length)
+               : conn->home != NULL ? conn->home
+                                    : server.instances;
+  pthread_mutex_unlock(&server.lock);
+  conn->ui = ui;
+  conn->metrics = ui != NULL ? &ui->metrics : &server.metrics;
+  if (ui == NULL) {
+    conn_respond(conn, "404 Not Found", NULL);
+    return;
+  }
+
+  if (prefixed) {
+    route += 3 + length;
+    if (*route != '/') {
+      // The page's relative URLs resolve against the trailing slash
+      if (!buffer_printf(&conn->response,
+                         "HTTP/1.1 301 Moved Permanently\r\n"
+                         "Location: /i/%s/%s\r\nContent-Length: 0\r\n%s\r\n",
+                         ui->name, route,
+                         conn->keepAlive ? "" : "Connection: close\r\n"))
+        conn->state = CONN_CLOSING;
+      if (!conn->keepAlive)
+        conn->closeAfterWrite = true;
+      return;
+    }
+    request->route = route;
+  }
+  handle_request(ui, conn, request);
+}
+
+
+static uint32_t osc_uint32(const uint8_t *data) {
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+         (uint32_t)data[2] << 8 | data[3];
+}
+
+// Length of the OSC string at data with its padding, 0 when it does not end
+// within size
+static size_t osc_string(const uint8_t *data, size_t size) {
+  size_t length = strnlen((const char *)data, size);
+  size_t padded = (length + 4) & ~(size_t)3;
+  return length < size && padded <= size ? padded : 0;
+}
+
+// The first argument as a number, false when there is none
+static bool osc_number(const char *types, const uint8_t *args, size_t size,
+                       double *number) {
+  char type = types[0] == ',' ? types[1] : '\0';
+  if ((type == 'i' || type == 'f') && size >= 4) {
+    uint32_t word = osc_uint32(args);
+    float single;
+    memcpy(&single, &word, sizeof(single));
+    *number = type == 'i' ? (int32_t)word : single;
+    return true;
+  }
+  if ((type == 'h' || type == 'd') && size >= 8) {
+    uint64_t word = (uint64_t)osc_uint32(args) << 32 | osc_uint32(args + 4);
+    double wide;
+    memcpy(&wide, &word, sizeof(wide));
+    *number = type == 'h' ? (int64_t)word : wide;
+    return true;
+  }
+  if (type == 'T' || type == 'F') {
+    *number = type == 'T';
+    return true;
+  }
+  return false;
+}
+
+// Queue the decoded changes, those of each instance together
+static void osc_flush(OscBatch_t *batch) {
+  ControlChange_t changes[OSC_MAX_CHANGES];
+  for (unsigned int i = 0; i < batch->count; i++) {
+    ThisUI *ui = batch->ui[i];
+    if (ui == NULL)
+      continue;
+    unsigned int count = 0;
+    for (unsigned int j = i; j < batch->count; j++) {
+      if (batch->ui[j] == ui) {
+        changes[count++] = batch->changes[j];
+        batch->ui[j] = NULL;
       }
-      */
-//      close(ui->clientSocket);
-//      continue;
-//    }
+    }
+    queue_changes(ui, changes, count);
+  }
+  batch->count = 0;
+}
 
-/*
-    if (!strcmp(route, "/controls")) {
-      sendControls(ui);
+// /<instance>/<symbol> with a number, clamped as by /control
+static bool osc_message(OscBatch_t *batch, const uint8_t *data, size_t size) {
+  size_t addressLength = osc_string(data, size);
+  if (addressLength == 0 || data[0] != '/')
+    return false;
+  size_t typesLength = osc_string(data + addressLength, size - addressLength);
+  double number;
+  if (typesLength == 0 ||
+      !osc_number((const char *)data + addressLength,
+                  data + addressLength + typesLength,
+                  size - addressLength - typesLength, &number))
+    return false;
+
+  const char *name = (const char *)data + 1;
+  const char *symbol = strchr(name, '/');
+  if (symbol == NULL)
+    return false;
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = find_instance(name, symbol - name);
+  pthread_mutex_unlock(&server.lock);
+  if (ui == NULL)
+    return false;
+  symbol++;
+  Control_t *control = find_control(ui, symbol, strlen(symbol));
+  float value = number;
+  if (control == NULL || !control_clamp(control, &value))
+    return false;
+  atomic_store_explicit(&control->value, value, memory_order_relaxed);
+
+  if (batch->count == OSC_MAX_CHANGES)
+    osc_flush(batch);
+  batch->ui[batch->count] = ui;
+  batch->changes[batch->count++] =
+      (ControlChange_t){control - ui->controls, value, 0};
+  metric_add(&ui->metrics.oscApplied, 1);
+  return true;
+}
+
+// A message or a bundle of packets. Time tags are not honoured, bundles are
+// applied as they arrive.
+static void osc_packet(OscBatch_t *batch, const uint8_t *data, size_t size,
+                       int depth) {
+  if (size < 16 || memcmp(data, "#bundle", 8) != 0) {
+    if (!osc_message(batch, data, size))
+      metric_add(&server.metrics.oscRejected, 1);
+    return;
+  }
+  if (depth == OSC_MAX_DEPTH) {
+    metric_add(&server.metrics.oscRejected, 1);
+    return;
+  }
+  for (size_t at = 16; at + 4 <= size;) {
+    uint32_t length = osc_uint32(data + at);
+    at += 4;
+    if (length > size - at || length % 4 != 0) {
+      metric_add(&server.metrics.oscRejected, 1);
+      return;
+    }
+    osc_packet(batch, data + at, length, depth + 1);
+    at += length;
+  }
+}
+
+// Queue every datagram waiting on the OSC socket
+static void osc_receive(void) {
+  uint8_t packet[OSC_PACKET_SIZE];
+  OscBatch_t batch = {.count = 0};
+  while (1) {
+    ssize_t n = recv(server.oscSocket, packet, sizeof(packet), MSG_TRUNC);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if ((size_t)n > sizeof(packet) || n % 4 != 0) {
+      metric_add(&server.metrics.oscRejected, 1);
       continue;
     }
-*/
-    float level;
-    if (sscanf(route, "/level/%f", &level) == 1) {
-        ui->write(ui->controller, 3, sizeof(level), 0, &level);
-        char response[200];
-        sprintf(response,
-                "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\n%f",
-                level);
-        send(ui->clientSocket, response, strlen(response), 0);
-        close(ui->clientSocket);
+    osc_packet(&batch, packet, n, 0);
+    osc_flush(&batch);
+  }
+}
+
+// Whether an Accept-Encoding value allows coding, honouring q=0 and "*"
+static bool accepts_encoding(const char *value, const char *coding) {
+  size_t length = strlen(coding);
+  const char *end = value + strlen(value);
+  bool wildcard = false;
+  while (value < end) {
+    value += strspn(value, " \t,");
+    size_t token = strcspn(value, " \t,;");
+    bool named = token == length && !strncasecmp(value, coding, length);
+    if (named || (token == 1 && *value == '*')) {
+      const char *q = value + token;
+      q += strspn(q, " \t");
+      bool allowed = true;
+      if (*q == ';') {
+        q += 1 + strspn(q + 1, " \t");
+        allowed = strncasecmp(q, "q=", 2) != 0 || strtod(q + 2, NULL) > 0;
+      }
+      if (named)
+        return allowed;
+      wildcard = allowed;
+    }
+    value += strcspn(value, ",");
+  }
+  return wildcard;
+}
+
+static int reject(HttpRequest_t *request, const char *status) {
+  request->error = status;
+  return -1;
+}
+
+static bool header_is(const char *name, size_t length, const char *expected) {
+  return length == strlen(expected) && !strncasecmp(name, expected, length);
+}
+
+// Position of the CR ending the line at p, NULL when it is not CRLF
+static char *line_end(char *p, char *limit) {
+  char *cr = memchr(p, '\r', limit - p);
+  return cr != NULL && cr + 1 < limit && cr[1] == '\n' ? cr : NULL;
+}
+
+// Parse the request line and header fields, end being the blank line
+static int parse_head(Connection_t *conn, HttpRequest_t *request, char *end) {
+  char *limit = end + 2;
+  char *line = conn->request;
+  char *lineEnd = line_end(line, limit);
+  if (lineEnd == NULL)
+    return reject(request, "400 Bad Request");
+
+  char *space = memchr(line, ' ', lineEnd - line);
+  if (space == NULL || space == line || space - line > MAX_METHOD)
+    return reject(request, "400 Bad Request");
+  request->method = line;
+  *space = '\0';
+
+  char *route = space + 1;
+  space = memchr(route, ' ', lineEnd - route);
+  if (space == NULL || *route != '/')
+    return reject(request, "400 Bad Request");
+  request->route = route;
+  *space = '\0';
+
+  char *version = space + 1;
+  if (lineEnd - version != 8 || strncmp(version, "HTTP/1.", 7) != 0)
+    return reject(request, "505 HTTP Version Not Supported");
+  request->keepAlive = version[7] != '0';
+
+  size_t headerLength = end + 4 - conn->request;
+  size_t contentLength = 0;
+  bool hasLength = false;
+  int headers = 0;
+  for (line = lineEnd + 2; line < limit; line = lineEnd + 2) {
+    lineEnd = line_end(line, limit);
+    if (lineEnd == NULL)
+      return reject(request, "400 Bad Request");
+    if (++headers > MAX_HEADERS)
+      return reject(request, "431 Request Header Fields Too Large");
+    char *colon = memchr(line, ':', lineEnd - line);
+    if (colon == NULL || colon == line)
+      return reject(request, "400 Bad Request");
+    size_t nameLength = colon - line;
+
+    char *value = colon + 1;
+    while (value < lineEnd && (*value == ' ' || *value == '\t'))
+      value++;
+    char *valueEnd = lineEnd;
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+      valueEnd--;
+    *valueEnd = '\0';
+
+    if (header_is(line, nameLength, "Connection")) {
+      if (!strcasecmp(value, "close"))
+        request->keepAlive = false;
+      else if (!strcasecmp(value, "keep-alive"))
+        request->keepAlive = true;
+    } else if (header_is(line, nameLength, "Content-Length")) {
+      char *digitsEnd;
+      unsigned long long length = strtoull(value, &digitsEnd, 10);
+      // Repeated with another value the body's end is ambiguous
+      if (*value < '0' || *value > '9' || *digitsEnd != '\0' ||
+          (hasLength && length != contentLength))
+        return reject(request, "400 Bad Request");
+      if (length > SIZE - 1 - headerLength)
+        return reject(request, "413 Content Too Large");
+      contentLength = length;
+      hasLength = true;
+    } else if (header_is(line, nameLength, "Transfer-Encoding")) {
+      return reject(request, "501 Not Implemented");
+    } else if (header_is(line, nameLength, "If-None-Match")) {
+      request->ifNoneMatch = value;
+    } else if (header_is(line, nameLength, "If-Modified-Since")) {
+      struct tm tm = {0};
+      if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+        request->ifModifiedSince = timegm(&tm);
+    } else if (header_is(line, nameLength, "Accept-Encoding")) {
+      request->acceptGzip = accepts_encoding(value, "gzip");
+      request->acceptBrotli = accepts_encoding(value, "br");
+    }
+  }
+
+  request->bodyOffset = headerLength;
+  request->bodyLength = contentLength;
+  request->length = headerLength + contentLength;
+  return 1;
+}
+
+// Returns 1 when the request at the start of the buffer is complete, 0 when
+// more bytes are needed and -1 when it cannot be served. The header block
+// is parsed once, as soon as it is complete; reads after that only extend
+// the search for its end or wait for the body.
+static int parse_request(Connection_t *conn) {
+  HttpRequest_t *request = &conn->current;
+  if (!conn->headersParsed) {
+    size_t from = conn->scanned > 3 ? conn->scanned - 3 : 0;
+    char *end = memmem(conn->request + from, conn->requestLength - from,
+                       "\r\n\r\n", 4);
+    if (end == NULL) {
+      conn->scanned = conn->requestLength;
+      return conn->requestLength >= SIZE - 1
+                 ? reject(request, "431 Request Header Fields Too Large")
+                 : 0;
+    }
+    *request = (HttpRequest_t){.ifModifiedSince = -1};
+    uint64_t start = now_ns();
+    if (parse_head(conn, request, end) < 0)
+      return -1;
+    histogram_record(&server.metrics.parseTime, now_ns() - start);
+    conn->headersParsed = true;
+  }
+  return request->length <= conn->requestLength;
+}
+
+// Answer every complete request in the buffer, in order
+static void conn_process(Connection_t *conn) {
+  while (conn->state == CONN_READING && !conn->closeAfterWrite &&
+         conn->file == NULL) {
+    HttpRequest_t *request = &conn->current;
+    int parsed = parse_request(conn);
+    if (parsed == 0)
+      return;
+    if (parsed < 0) {
+      conn->keepAlive = false;
+      conn_respond(conn, request->error, NULL);
+      return;
+    }
+
+    conn->keepAlive = request->keepAlive;
+    route_request(conn, request);
+
+    conn->requestLength -= request->length;
+    memmove(conn->request, conn->request + request->length,
+            conn->requestLength);
+    conn->request[conn->requestLength] = '\0';
+    conn->headersParsed = false;
+    conn->scanned = 0;
+  }
+}
+
+// Connections and their arenas are allocated once, so serving requests
+// needs no heap traffic unless a response outgrows its arena
+static bool pool_init(Worker_t *worker) {
+  worker->connections = calloc(MAX_CONNECTIONS, sizeof(Connection_t));
+  worker->arenas = malloc(MAX_CONNECTIONS * ARENA_SIZE);
+  if (worker->connections == NULL || worker->arenas == NULL)
+    return false;
+  for (int i = MAX_CONNECTIONS - 1; i >= 0; i--) {
+    Connection_t *conn = &worker->connections[i];
+    char *arena = worker->arenas + i * ARENA_SIZE;
+    conn->body = (Buffer_t){arena, 0, ARENA_SIZE / 4, arena, ARENA_SIZE / 4};
+    arena += ARENA_SIZE / 4;
+    conn->response = (Buffer_t){arena, 0, ARENA_SIZE - ARENA_SIZE / 4, arena,
+                                ARENA_SIZE - ARENA_SIZE / 4};
+    conn->socket = -1;
+    conn->worker = worker;
+    conn->fileFd = -1;
+    conn->nextFree = worker->freeConnections;
+    worker->freeConnections = conn;
+  }
+  return true;
+}
+
+static void pool_free(Worker_t *worker) {
+  for (int i = 0; worker->connections != NULL && i < MAX_CONNECTIONS; i++) {
+    Connection_t *conn = &worker->connections[i];
+    if (conn->socket >= 0)
+      close(conn->socket);
+    release_file(conn);
+    buffer_recycle(&conn->body);
+    buffer_recycle(&conn->response);
+  }
+  free(worker->connections);
+  free(worker->arenas);
+  worker->connections = NULL;
+  worker->arenas = NULL;
+  worker->freeConnections = NULL;
+}
+
+static Connection_t *conn_acquire(Worker_t *worker, int socket) {
+  Connection_t *conn = worker->freeConnections;
+  if (conn == NULL)
+    return NULL;
+  worker->freeConnections = conn->nextFree;
+
+  Buffer_t body = conn->body;
+  Buffer_t response = conn->response;
+  memset(conn, 0, sizeof(Connection_t));
+  conn->body = body;
+  conn->response = response;
+  conn->socket = socket;
+  conn->worker = worker;
+  conn->metrics = &server.metrics;
+  conn->state = CONN_READING;
+  conn->fileFd = -1;
+  atomic_fetch_add_explicit(&server.metrics.connections, 1,
+                            memory_order_relaxed);
+  return conn;
+}
+
+static void conn_recycle(Connection_t *conn) {
+  atomic_fetch_sub_explicit(&server.metrics.connections, 1,
+                            memory_order_relaxed);
+  conn->socket = -1;
+  buffer_recycle(&conn->body);
+  buffer_recycle(&conn->response);
+  conn->nextFree = conn->worker->freeConnections;
+  conn->worker->freeConnections = conn;
+}
+
+static void conn_close(Connection_t *conn) {
+  epoll_ctl(conn->worker->epollFd, EPOLL_CTL_DEL, conn->socket, NULL);
+  close(conn->socket);
+  release_file(conn);
+  conn_recycle(conn);
+}
+
+static void conn_receive(Connection_t *conn);
+
+// Flush as much of the queued responses as the socket takes without blocking
+static void conn_write(Connection_t *conn) {
+  Buffer_t *response = &conn->response;
+  while (conn->state != CONN_CLOSING) {
+    ssize_t n;
+    if (conn->responseSent < response->length) {
+      // Hold back a partial segment of headers until the file body follows,
+      // Nagle would otherwise wait for the client's delayed ACK
+      int more = conn->file != NULL ? MSG_MORE : 0;
+      n = send(conn->socket, response->data + conn->responseSent,
+               response->length - conn->responseSent, MSG_NOSIGNAL | more);
+    } else if (conn->file != NULL && conn->fileSent < conn->file->length) {
+      if (conn->file->body != NULL) {
+        n = send(conn->socket, conn->file->body + conn->fileSent,
+                 conn->file->length - conn->fileSent, MSG_NOSIGNAL);
+      } else {
+        off_t offset = conn->fileSent;
+        n = sendfile(conn->socket, conn->fileFd, &offset,
+                     conn->file->length - conn->fileSent);
+      }
+      if (n > 0) {
+        conn->fileSent += n;
+        metric_add(&server.metrics.bytesSent, n);
+      } else if (n == 0) {
+        conn->state = CONN_CLOSING; // file shrank since startup
+      }
+      if (n >= 0)
         continue;
+    } else if (conn->file != NULL) {
+      // Answer the pipelined requests held back by the file body
+      response->length = 0;
+      conn->responseSent = 0;
+      release_file(conn);
+      conn_receive(conn);
+      continue;
+    } else {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        conn->state = CONN_CLOSING;
+      return;
     }
+    conn->responseSent += n;
+    metric_add(&server.metrics.bytesSent, n);
+  }
+  response->length = 0;
+  conn->responseSent = 0;
+  if (conn->closeAfterWrite && conn->state == CONN_READING)
+    conn->state = CONN_CLOSING;
+}
 
-/*
-    if (!strcmp(route, "/programs")) {
-      char response[200];
-      sprintf(response,
-              "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nAccess-Control-Allow-Origin: *\r\n\r\n{");
-      send(ui->clientSocket, response, strlen(response), 0);
-      for (int i = 0; i < 128; i++) {
-        if (i == 0)
-           sprintf(response, "\"%d\": \"%s\"", i, &ui->program[i][0]);
-        else {
-           if (strlen(&ui->program[i][0]) > 0)
-             sprintf(response, ",\"%d\": \"%s\"", i, &ui->program[i][0]);
-           else
-             strcpy(response,"");
-        }
-        send(ui->clientSocket, response, strlen(response), 0);
+// Answer the complete requests already buffered, then read what the socket
+// has and answer the complete requests among it
+static void conn_receive(Connection_t *conn) {
+  conn_process(conn);
+  while (conn->state == CONN_READING && !conn->closeAfterWrite &&
+         conn->requestLength < SIZE - 1) {
+    ssize_t n = read(conn->socket, conn->request + conn->requestLength,
+                     SIZE - 1 - conn->requestLength);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        conn->state = CONN_CLOSING;
+      return;
+    }
+    if (n == 0) {
+      conn->closeAfterWrite = true;
+      return;
+    }
+    conn->requestLength += n;
+    conn->request[conn->requestLength] = '\0';
+    conn_process(conn);
+  }
+}
+
+// Clients of the shared port, or of home's Unix-domain socket
+static void accept_connections(Worker_t *worker, int listenSocket,
+                               ThisUI *home) {
+  while (1) {
+    int clientSocket =
+        accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientSocket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    Connection_t *conn = conn_acquire(worker, clientSocket);
+    if (conn == NULL) {
+      static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n\r\n";
+      send(clientSocket, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+      close(clientSocket);
+      continue;
+    }
+    conn->home = home;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP |
+                                          EPOLLET,
+                                .data.ptr = conn};
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+      close(clientSocket);
+      conn_recycle(conn);
+    }
+  }
+}
+
+static void worker_wake(Worker_t *worker) {
+  uint64_t one = 1;
+  write(worker->wakeFd, &one, sizeof(one));
+}
+
+// Let go of a detaching instance, so that it can be freed, and tell whether
+// the server is to stop. The worker's connections stay open for the other
+// instances, except those that came in on its Unix-domain socket: they
+// finish what they were sending and close.
+static bool handle_wake(Worker_t *worker) {
+  uint64_t count;
+  while (read(worker->wakeFd, &count, sizeof(count)) > 0)
+    ;
+
+  pthread_mutex_lock(&server.lock);
+  ThisUI *ui = worker->detaching;
+  bool stopping = server.stopping;
+  pthread_mutex_unlock(&server.lock);
+
+  if (ui != NULL) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+      Connection_t *conn = &worker->connections[i];
+      if (conn->socket < 0)
+        continue;
+      if (conn->ui == ui) {
+        conn->ui = NULL;
+        conn->metrics = &server.metrics;
+      }
+      if (conn->home == ui) {
+        conn->home = NULL;
+        conn->closeAfterWrite = true;
+        conn_write(conn);
+        if (conn->state == CONN_CLOSING)
+          conn_close(conn);
       }
-      send(ui->clientSocket, "}", 1, 0);
-      close(ui->clientSocket);
+    }
+
+    pthread_mutex_lock(&server.lock);
+    worker->detaching = NULL;
+    if (--server.detachPending == 0)
+      pthread_cond_broadcast(&server.detached);
+    pthread_mutex_unlock(&server.lock);
+  }
+  return stopping;
+}
+
+// Release the worker's share of the port at once, then give the responses
+// already queued up to DRAIN_TIMEOUT_MS to go out. No further requests are
+// read.
+static void worker_drain(Worker_t *worker) {
+  epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, worker->serverSocket, NULL);
+  close(worker->serverSocket);
+  worker->serverSocket = -1;
+
+  int open = 0;
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    Connection_t *conn = &worker->connections[i];
+    if (conn->socket < 0)
       continue;
+    conn->closeAfterWrite = true;
+    conn_write(conn);
+    if (conn->state == CONN_CLOSING)
+      conn_close(conn);
+    else
+      open++;
+  }
+
+  uint64_t deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000ull;
+  struct epoll_event events[MAX_EVENTS];
+  for (uint64_t now = now_ns(); open > 0 && now < deadline; now = now_ns()) {
+    int n = epoll_wait(worker->epollFd, events, MAX_EVENTS,
+                       (deadline - now) / 1000000 + 1);
+    for (int i = 0; i < n; i++) {
+      Connection_t *conn = events[i].data.ptr;
+      if (conn < worker->connections ||
+          conn >= worker->connections + MAX_CONNECTIONS || conn->socket < 0)
+        continue;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        conn->state = CONN_CLOSING;
+      conn_write(conn);
+      if (conn->state == CONN_CLOSING) {
+        conn_close(conn);
+        open--;
+      }
     }
-*/
-    if (!strcmp(route, "/"))
-      strcat(route, "index.html");
+  }
+}
 
-    char filepath[200];
-    sprintf(filepath, "%s/%s", ui->static_path, &route[1]);
-    send_file_to_socket(filepath, ui->clientSocket);
-    close(ui->clientSocket);
+static void *worker_run(void *arg) {
+  Worker_t *worker = arg;
+
+  // A client going away during sendfile must not take the host down
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  bool stopping = false;
+  while (!stopping) {
+    int n = epoll_wait(worker->epollFd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("Error: The server event loop failed.\n");
+      break;
+    }
+
+    // Instances detach between batches, as events already taken may still
+    // be for them
+    bool woken = false;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &worker->serverSocket) {
+        accept_connections(worker, worker->serverSocket, NULL);
+        continue;
+      }
+      if (events[i].data.ptr >= (void *)server.listeners &&
+          events[i].data.ptr < (void *)(server.listeners + MAX_LISTENERS)) {
+        Listener_t *listener = events[i].data.ptr;
+        accept_connections(worker, listener->socket, listener->ui);
+        continue;
+      }
+      if (events[i].data.ptr == &worker->wakeFd) {
+        woken = true;
+        continue;
+      }
+      if (events[i].data.ptr == &server.oscSocket) {
+        osc_receive();
+        continue;
+      }
+
+      Connection_t *conn = events[i].data.ptr;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+        conn->state = CONN_CLOSING;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+        conn_receive(conn);
+      conn_write(conn);
+      if (conn->state == CONN_CLOSING)
+        conn_close(conn);
+    }
+    if (woken)
+      stopping = handle_wake(worker);
+  }
+  if (stopping)
+    worker_drain(worker);
+
+  // Detaching instances no longer wait for this worker
+  pthread_mutex_lock(&server.lock);
+  worker->serving = false;
+  if (worker->detaching != NULL) {
+    worker->detaching = NULL;
+    if (--server.detachPending == 0)
+      pthread_cond_broadcast(&server.detached);
   }
+  pthread_mutex_unlock(&server.lock);
   return NULL;
 }
+
+// Bind the worker's listening socket and set up its event loop. Several
+// workers share the port with SO_REUSEPORT, which is only set then: with it a
+// second process would quietly take a share of the clients instead of
+// failing to bind.
+static bool worker_open(Worker_t *worker, int port) {
+  if (!pool_init(worker)) {
+    printf("Error: No memory for the connection pool.\n");
+    return false;
+  }
+
+  struct sockaddr_in serverAddress;
+  serverAddress.sin_family = AF_INET; // IPv4
+  serverAddress.sin_port =
+      htons(port); // port number in network byte order
+                   // (host-to-network short)
+  serverAddress.sin_addr.s_addr =
+      htonl(INADDR_ANY); // localhost (host to network long)
+
+  worker->serverSocket =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  setsockopt(worker->serverSocket, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+             sizeof(int));
+  if (server.nmbWorkers > 1)
+    setsockopt(worker->serverSocket, SOL_SOCKET, SO_REUSEPORT, &(int){1},
+               sizeof(int));
+
+  if (bind(worker->serverSocket, (struct sockaddr *)&serverAddress,
+           sizeof(serverAddress)) < 0) {
+    printf("Error: The server is not bound to the address.\n");
+    return false;
+  }
+
+  if (listen(worker->serverSocket, BACKLOG) < 0) {
+    printf("Error: The server is not listening.\n");
+    return false;
+  }
+
+  worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->epollFd < 0 || worker->wakeFd < 0) {
+    printf("Error: The server has no event loop.\n");
+    return false;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                              .data.ptr = &worker->serverSocket};
+  epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->serverSocket, &event);
+  event.data.ptr = &worker->wakeFd;
+  epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event);
+  return true;
+}
+
+// Take OSC messages over UDP on OSC_PORT, when it is set. The first worker
+// serves them. The server runs without OSC if the port cannot be bound.
+static void osc_open(void) {
+  const char *port = getenv("OSC_PORT");
+  if (port == NULL || atoi(port) <= 0)
+    return;
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(atoi(port)),
+                                .sin_addr.s_addr = htonl(INADDR_ANY)};
+  server.oscSocket =
+      socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server.oscSocket < 0 ||
+      bind(server.oscSocket, (struct sockaddr *)&address, sizeof(address)) <
+          0) {
+    printf("Error: The OSC socket is not bound to the address.\n");
+    if (server.oscSocket >= 0)
+      close(server.oscSocket);
+    server.oscSocket = -1;
+    return;
+  }
+  struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                              .data.ptr = &server.oscSocket};
+  epoll_ctl(server.workers[0].epollFd, EPOLL_CTL_ADD, server.oscSocket,
+            &event);
+}
+
+// Stop the workers that run and wait for them
+static void server_stop(void) {
+  pthread_mutex_lock(&server.lock);
+  server.stopping = true;
+  pthread_mutex_unlock(&server.lock);
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    if (!worker->started)
+      continue;
+    worker_wake(worker);
+    pthread_join(worker->thread, NULL);
+    worker->started = false;
+  }
+}
+
+static void server_free(void) {
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    if (worker->serverSocket >= 0)
+      close(worker->serverSocket);
+    if (worker->epollFd >= 0)
+      close(worker->epollFd);
+    if (worker->wakeFd >= 0)
+      close(worker->wakeFd);
+    worker->serverSocket = worker->epollFd = worker->wakeFd = -1;
+    pool_free(worker);
+  }
+  server.nmbWorkers = 0;
+  if (server.oscSocket >= 0)
+    close(server.oscSocket);
+  server.oscSocket = -1;
+  free_static_files();
+}
+
+// Load the static files, bind the port and start the workers,
+// UI_BRIDGE_WORKERS of them, one by default
+static bool server_start(const char *staticPath, int port) {
+  load_static_files(staticPath, "");
+  prepare_static_files();
+
+  const char *workers = getenv("UI_BRIDGE_WORKERS");
+  server.nmbWorkers = workers != NULL ? atoi(workers) : 1;
+  if (server.nmbWorkers < 1)
+    server.nmbWorkers = 1;
+  if (server.nmbWorkers > MAX_WORKERS)
+    server.nmbWorkers = MAX_WORKERS;
+  for (int i = 0; i < server.nmbWorkers; i++)
+    server.workers[i] =
+        (Worker_t){.serverSocket = -1, .epollFd = -1, .wakeFd = -1};
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    if (!worker_open(&server.workers[i], port))
+      return false;
+  }
+  osc_open();
+
+  server.stopping = false;
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    worker->serving = true;
+    int k = pthread_create(&worker->thread, NULL, worker_run, worker);
+    if (k != 0) {
+      fprintf(stderr, "%d : %s\n", k, "pthread_create : HTTPServer thread");
+      fflush(stderr);
+      worker->serving = false;
+      return false;
+    }
+    worker->started = true;
+  }
+  return true;
+}
+
+// UI_BRIDGE_NAME, numbered when instances in this process share it.
+// Caller holds server.lock.
+static const char *instance_name(ThisUI *ui) {
+  const char *name = getenv("UI_BRIDGE_NAME");
+  if (name == NULL || *name == '\0' || strpbrk(name, "/?") != NULL)
+    name = "liquidsfz";
+  snprintf(ui->name, sizeof(ui->name), "%s", name);
+  bool numbered = false;
+  for (int n = 2; find_instance(ui->name, strlen(ui->name)) != NULL; n++) {
+    snprintf(ui->name, sizeof(ui->name), "%.50s-%d", name, n);
+    numbered = true;
+  }
+  return numbered ? strrchr(ui->name, '-') : "";
+}
+
+// A listening Unix-domain socket at the address, -1 when it cannot be bound.
+// A socket left there by a process that is gone is replaced, one that still
+// takes connections is not.
+static int local_socket(const struct sockaddr_un *address) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  const struct sockaddr *at = (const struct sockaddr *)address;
+  bool bound = bind(fd, at, sizeof(*address)) == 0;
+  if (!bound && errno == EADDRINUSE) {
+    struct stat status;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && lstat(address->sun_path, &status) == 0 &&
+        S_ISSOCK(status.st_mode) && connect(probe, at, sizeof(*address)) < 0 &&
+        errno == ECONNREFUSED) {
+      unlink(address->sun_path);
+      bound = bind(fd, at, sizeof(*address)) == 0;
+    }
+    if (probe >= 0)
+      close(probe);
+  }
+  if (!bound || listen(fd, BACKLOG) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Listen for the instance on UI_BRIDGE_SOCKET too, when it is set. A path
+// ending in '/' is a directory that gets <name>.sock, any other path is
+// numbered as the name is when instances in this process share it.
+static void listener_open(ThisUI *ui, const char *suffix) {
+  const char *path = getenv("UI_BRIDGE_SOCKET");
+  if (path == NULL || *path == '\0' || !server.started)
+    return;
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  size_t length =
+      path[strlen(path) - 1] == '/'
+          ? snprintf(address.sun_path, sizeof(address.sun_path), "%s%s.sock",
+                     path, ui->name)
+          : snprintf(address.sun_path, sizeof(address.sun_path), "%s%s", path,
+                     suffix);
+  int listenSocket =
+      length < sizeof(address.sun_path) ? local_socket(&address) : -1;
+  if (listenSocket < 0) {
+    printf("Error: The local socket is not bound to %s.\n", address.sun_path);
+    return;
+  }
+
+  Listener_t *listener = NULL;
+  pthread_mutex_lock(&server.lock);
+  for (int i = 0; i < MAX_LISTENERS && listener == NULL; i++) {
+    if (server.listeners[i].ui == NULL) {
+      listener = &server.listeners[i];
+      *listener = (Listener_t){.ui = ui, .socket = listenSocket};
+      memcpy(listener->path, address.sun_path, sizeof(listener->path));
+    }
+  }
+  pthread_mutex_unlock(&server.lock);
+  if (listener == NULL) {
+    printf("Error: No room for another local socket.\n");
+    close(listenSocket);
+    unlink(address.sun_path);
+    return;
+  }
+  ui->listener = listener;
+
+  // One worker is woken for each client
+  struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                              .data.ptr = listener};
+  for (int i = 0; i < server.nmbWorkers; i++)
+    epoll_ctl(server.workers[i].epollFd, EPOLL_CTL_ADD, listenSocket, &event);
+}
+
+
+// Register the instance with the server, starting it for the first one.
+// Later instances share its port, whatever HTTP_PORT they were given.
+static void server_attach(ThisUI *ui, int port) {
+  pthread_mutex_lock(&server.lifecycle);
+  if (server.refs++ == 0) {
+    server.started = server_start(ui->static_path, port);
+    if (!server.started) {
+      server_stop();
+      server_free();
+    }
+  }
+
+  pthread_mutex_lock(&server.lock);
+  const char *suffix = instance_name(ui);
+  ThisUI **last = &server.instances;
+  while (*last != NULL)
+    last = &(*last)->nextInstance;
+  *last = ui;
+  pthread_mutex_unlock(&server.lock);
+  listener_open(ui, suffix);
+  pthread_mutex_unlock(&server.lifecycle);
+}
+
+// Unregister the instance once every worker has let go of it, and stop the
+// server with the last one
+static void server_detach(ThisUI *ui) {
+  pthread_mutex_lock(&server.lifecycle);
+  pthread_mutex_lock(&server.lock);
+  for (ThisUI **at = &server.instances; *at != NULL;
+       at = &(*at)->nextInstance) {
+    if (*at == ui) {
+      *at = ui->nextInstance;
+      break;
+    }
+  }
+  for (int i = 0; i < server.nmbWorkers; i++) {
+    Worker_t *worker = &server.workers[i];
+    if (ui->listener != NULL)
+      epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, ui->listener->socket, NULL);
+    if (worker->serving) {
+      worker->detaching = ui;
+      server.detachPending++;
+      worker_wake(worker);
+    }
+  }
+  while (server.detachPending > 0)
+    pthread_cond_wait(&server.detached, &server.lock);
+  if (ui->listener != NULL) {
+    close(ui->listener->socket);
+    unlink(ui->listener->path);
+    ui->listener->ui = NULL;
+    ui->listener = NULL;
+  }
+  bool last = --server.refs == 0;
+  pthread_mutex_unlock(&server.lock);
+
+  if (last && server.started) {
+    server_stop();
+    server.started = false;
+    server_free();
+  }
+  pthread_mutex_unlock(&server.lifecycle);
+}